@@ -0,0 +1,288 @@
+#define BRICK_BENCHMARK_REG
+
+#include "doc/convert.hpp"
+#include "doc/w_html.hpp"
+#include "doc/w_context.hpp"
+
+#include <brick-benchmark>
+#include <codecvt>
+#include <locale>
+#include <fcntl.h>
+#include <pthread.h>
+
+/* Benchmarks of the document converter, on generated documents. */
+
+namespace umd::b_doc
+{
+    using namespace brick::benchmark;
+    using sv = std::u32string_view;
+
+    /* Lecture notes: a section with running text, a nested list, a code
+     * block, a quote and display math, repeated ‹count› times. */
+
+    static const sv section =
+        U"# Section\n"
+        U"\n"
+        U"Running text with «emphasis», ‹monospace› and ❮bold❯ words and\n"
+        U"inline math ⟦x₁ + y² = z⟧, long enough to wrap onto a second line.\n"
+        U"\n"
+        U" • a bullet\n"
+        U"   ◦ a nested bullet\n"
+        U" • another bullet\n"
+        U"\n"
+        U"    int f( int x )\n"
+        U"    {\n"
+        U"        return x + 1;\n"
+        U"    }\n"
+        U"\n"
+        U"> a quoted line\n"
+        U"\n"
+        U"  ⟦ a + b = c\n"
+        U"    d     = e + f ⟧\n"
+        U"\n";
+
+    static std::u32string notes( int count )
+    {
+        std::u32string doc = U": doctype : html\n: title : Notes\n\n";
+
+        for ( int i = 0; i < count; ++i )
+            doc += section;
+
+        return doc;
+    }
+
+    /* the notes with (at least) ‹n› lines, resp. ‹n› KiB of UTF-8 */
+    static std::u32string notes_lines( int n ) { return notes( 1 + n / std::count( section.begin(), section.end(), U'\n' ) ); }
+    static std::u32string notes_kib( int n )   { return notes( 1 + n * 1024 / to_utf8( section ).size() ); }
+
+    /* run ‹f› on a thread of its own, with a stack of ‹size› bytes */
+    template< typename F >
+    void on_stack( size_t size, F f )
+    {
+        pthread_attr_t attr;
+        pthread_t thread;
+
+        auto run = []( void *f ) -> void * { ( *static_cast< F * >( f ) )(); return nullptr; };
+
+        pthread_attr_init( &attr );
+        pthread_attr_setstacksize( &attr, size );
+
+        if ( pthread_create( &thread, &attr, run, &f ) )
+            throw std::runtime_error( "could not start a thread" );
+
+        pthread_attr_destroy( &attr );
+        pthread_join( thread, nullptr );
+    }
+
+    /* The whole conversion of the notes into HTML, reported per line. The
+     * conversion runs on a stack of 256 KiB (the default is usually 8 MiB),
+     * which a recursion per line of input (as body() once was) would
+     * overflow long before the end of the document. */
+
+    struct body : Group
+    {
+        std::u32string text;
+
+        body()
+        {
+            x.type = Axis::Quantitative;
+            x.name = "lines";
+            x.unit = "k";
+            x.unit_div = 1000;
+            x.min = 125000;
+            x.max = 1000000;
+            x.log = true;
+            x.step = 2;
+            x.normalize = Axis::Div;
+        }
+
+        std::string describe() { return "category:doc category:body"; }
+
+        void setup( int _p, int _q )
+        {
+            Group::setup( _p, _q );
+            text = notes_lines( p );
+        }
+
+        BENCHMARK(html)
+        {
+            int fd = open( "/dev/null", O_WRONLY );
+
+            on_stack( 256 * 1024, [&]
+            {
+                doc::stream out( fd );
+                doc::w_html w( out );
+                doc::convert conv( text, w );
+                conv.run();
+            } );
+
+            close( fd );
+        }
+    };
+
+    /* The throughput of the writers, on notes of 512 KiB to 4 MiB, reported
+     * as time per KiB of input. The ‹virtual› variant runs the HTML writer
+     * through convert<> (i.e. every call to the writer is a virtual call, as
+     * for w_doctype or w_profile), the others through a converter that is
+     * instantiated for the writer. */
+
+    struct writers : Group
+    {
+        std::u32string text;
+
+        writers()
+        {
+            x.type = Axis::Quantitative;
+            x.name = "input";
+            x.unit = "KiB";
+            x.min = 512;
+            x.max = 4096;
+            x.log = true;
+            x.step = 2;
+            x.normalize = Axis::Div;
+        }
+
+        std::string describe() { return "category:doc category:writers"; }
+
+        void setup( int _p, int _q )
+        {
+            Group::setup( _p, _q );
+            text = notes_kib( p );
+        }
+
+        template< typename writer_t, typename conv_t = doc::convert< writer_t > >
+        void convert()
+        {
+            int fd = open( "/dev/null", O_WRONLY );
+
+            {
+                doc::stream out( fd );
+                writer_t w( out );
+                conv_t conv( text, w );
+                conv.run();
+            }
+
+            close( fd );
+        }
+
+        BENCHMARK(html) { convert< doc::w_html >(); }
+        BENCHMARK(html_virtual) { convert< doc::w_html, doc::convert<> >(); }
+        BENCHMARK(context) { convert< doc::w_context >(); }
+    };
+
+    /* Encoding the output: the text of the notes, split into the words and
+     * the spaces between them (about the size of the strings that the
+     * writers emit), is written through a doc::stream and through the path
+     * that stream::emit used to take (a std::wstring_convert for each string
+     * and a std::ostream). The time is per KiB of input. */
+
+    struct encode : Group
+    {
+        std::u32string text;
+        std::vector< sv > tokens;
+
+        encode()
+        {
+            x.type = Axis::Quantitative;
+            x.name = "input";
+            x.unit = "KiB";
+            x.min = 512;
+            x.max = 4096;
+            x.log = true;
+            x.step = 2;
+            x.normalize = Axis::Div;
+        }
+
+        std::string describe() { return "category:doc category:encode"; }
+
+        void setup( int _p, int _q )
+        {
+            Group::setup( _p, _q );
+            text = notes_kib( p );
+
+            for ( size_t i = 0, j; i < text.size(); i = j )
+            {
+                j = text[ i ] == U' ' ? i + 1 : std::min( text.find( U' ', i ), text.size() );
+                tokens.push_back( sv( text ).substr( i, j - i ) );
+            }
+        }
+
+        BENCHMARK(stream)
+        {
+            int fd = open( "/dev/null", O_WRONLY );
+
+            {
+                doc::stream out( fd );
+                for ( auto t : tokens )
+                    out.emit( t );
+            }
+
+            close( fd );
+        }
+
+        BENCHMARK(wstring_convert)
+        {
+            std::ofstream out( "/dev/null" );
+
+            for ( auto t : tokens )
+            {
+                std::wstring_convert< std::codecvt_utf8< char32_t >, char32_t > conv;
+                out << conv.to_bytes( t.begin(), t.end() );
+            }
+        }
+    };
+
+    /* Display math alone: 100 displays of 50 lines each, aligned on ‹=›,
+     * ‹→› and the arithmetic operators, with lines that end in a tail of
+     * about ‹p› more operators (uneven across lines). The writer does
+     * nothing, so the time is that of try_dispmath, reported per operator
+     * of the tail. */
+
+    struct dispmath : Group
+    {
+        std::u32string text;
+
+        dispmath()
+        {
+            x.type = Axis::Quantitative;
+            x.name = "width";
+            x.unit = "ops";
+            x.min = 16;
+            x.max = 1024;
+            x.log = true;
+            x.step = 4;
+            x.normalize = Axis::Div;
+        }
+
+        std::string describe() { return "category:doc category:dispmath"; }
+
+        void setup( int _p, int _q )
+        {
+            Group::setup( _p, _q );
+            text = U": doctype : lnotes\n\n";
+
+            for ( int d = 0; d < 100; ++d )
+            {
+                for ( int n = 0; n < 50; ++n )
+                {
+                    text += n ? U"   " : U"  ⟦";
+                    text += U"x_" + from_utf8( std::to_string( n ) ) + U" = a + b ⋅ c − d / e → f = g + h";
+
+                    for ( int i = 0; i < p + ( n * 7 ) % 13; ++i )
+                        text += U" + y";
+
+                    text += n == 49 ? U"⟧\n" : U"\n";
+                }
+
+                text += U"\n";
+            }
+        }
+
+        BENCHMARK(noop)
+        {
+            doc::w_noop w;
+            doc::convert<> conv( text, w );
+            conv.run();
+        }
+    };
+}
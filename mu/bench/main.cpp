@@ -0,0 +1,10 @@
+/* The driver of the benchmarks in this directory, which register themselves
+ * with brick-benchmark. Build with ‹make bin/mu-bench›; since the default
+ * flags do not optimise, put e.g. ‹add cxxflags -O2› into ‹gib/local›
+ * first. The arguments select the benchmarks whose description contains all
+ * of them, e.g. ‹mu-bench category:doc›, and ‹--list› lists them instead.
+ * Results are cached in ‹benchmark.log› in the current directory and a
+ * gnuplot script with the plots is written to stdout. */
+
+#define BRICK_BENCHMARK_MAIN
+#include <brick-benchmark>
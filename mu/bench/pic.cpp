@@ -0,0 +1,194 @@
+#define BRICK_BENCHMARK_REG
+
+#include "doc/util.hpp"
+#include "doc/writer.hpp"
+#include "pic/reader.hpp"
+#include "pic/convert.hpp"
+
+#include <brick-benchmark>
+#include <cstdlib>
+
+/* Benchmarks of the diagram converter, on generated diagrams. */
+
+namespace umd::b_pic
+{
+    using namespace brick::benchmark;
+    using sv = std::u32string_view;
+
+    /* A diagram of ‹count› labelled boxes, 40 to a row, each connected to
+     * its neighbour on the right and to the one below (if any) by an arrow:
+     *
+     *     ┌────┐   ┌────┐
+     *     │b001│──▶│b002│
+     *     └────┘   └────┘
+     *       │        │
+     *       ▼        ▼
+     *     ┌────┐   ┌────┐                                                  */
+
+    static std::u32string boxes( int count )
+    {
+        constexpr int cols = 40;
+        int rows = ( count + cols - 1 ) / cols;
+        std::u32string pic;
+
+        for ( int r = 0; r < rows; ++ r )
+        {
+            int n = std::min( cols, count - r * cols );
+            bool below = r < rows - 1 && ( r + 1 ) * cols < count;
+            std::u32string line[ 5 ];
+
+            for ( int c = 0; c < n; ++ c )
+            {
+                auto label = std::to_string( ( r * cols + c ) % 1000 );
+                bool right = c < n - 1, down = ( r + 1 ) * cols + c < count;
+
+                line[ 0 ] += U"┌────┐";
+                line[ 1 ] += U"│b" + from_utf8( std::string( 3 - label.size(), '0' ) + label ) + U"│";
+                line[ 2 ] += U"└────┘";
+                line[ 3 ] += down ? U"  │   " : U"      ";
+                line[ 4 ] += down ? U"  ▼   " : U"      ";
+
+                line[ 0 ] += U"   ";
+                line[ 1 ] += right ? U"──▶" : U"   ";
+                line[ 2 ] += U"   ";
+                line[ 3 ] += U"   ";
+                line[ 4 ] += U"   ";
+            }
+
+            for ( int l = 0; l < ( below ? 5 : 3 ); ++ l )
+                pic += line[ l ] + U"\n";
+        }
+
+        return pic;
+    }
+
+    /* Reading the grid, and building the scene (which includes reading the
+     * grid), for 150 to 2400 boxes; reported per box. */
+
+    struct scene : Group
+    {
+        std::u32string text;
+
+        scene()
+        {
+            x.type = Axis::Quantitative;
+            x.name = "boxes";
+            x.min = 150;
+            x.max = 2400;
+            x.log = true;
+            x.step = 2;
+            x.normalize = Axis::Div;
+        }
+
+        std::string describe() { return "category:pic category:scene"; }
+
+        void setup( int _p, int _q )
+        {
+            Group::setup( _p, _q );
+            text = boxes( p );
+        }
+
+        BENCHMARK(grid) { pic::reader::read_grid( text ); }
+        BENCHMARK(convert) { pic::convert::scene( pic::reader::read_grid( text ) ); }
+    };
+
+    /* The corpus in ‹corpus.pic› next to this file: 200 generated diagrams
+     * (chains and columns of boxes, tables, nodes, shaded, rounded and
+     * dashed boxes), separated by empty lines as for ‹mu-pic -›. It is read
+     * from ‹$MU_PIC_CORPUS›, or from ‹mu/bench/corpus.pic› relative to the
+     * current directory (i.e. run mu-bench from the top of the source tree).
+     * Each diagram is converted into MetaPost in memory, as by mu-pic, but
+     * one after another. The corpus is repeated as needed to get ‹p›
+     * diagrams (resp. cells), and the time is per diagram (resp. per cell),
+     * i.e. the inverse of diagrams/s (resp. cells/s); ‹mu-pic -t› reports
+     * the rates of the whole pipeline (with its threads) on the same file. */
+
+    struct mpost : pic::writer, doc::stream
+    {
+        mpost() : doc::stream( -1 ) {}
+        void emit_mpost( std::string_view s ) { emit( s ); }
+        void emit_tex( std::u32string_view s ) { emit( s ); }
+    };
+
+    struct corpus : Group
+    {
+        std::u32string text;
+        std::vector< std::u32string_view > all, diagrams;
+
+        virtual bool enough( size_t count, size_t cells ) = 0;
+
+        void setup( int _p, int _q )
+        {
+            Group::setup( _p, _q );
+
+            auto path = std::getenv( "MU_PIC_CORPUS" );
+            text = read_file( path ? path : "mu/bench/corpus.pic" );
+
+            for ( sv rest = text; !rest.empty(); )
+            {
+                auto end = std::min( rest.find( U"\n\n" ), rest.size() - 1 ) + 1;
+                all.push_back( rest.substr( 0, end ) );
+                rest.remove_prefix( std::min( end + 1, rest.size() ) );
+            }
+
+            if ( all.empty() )
+                throw std::runtime_error( "the corpus of diagrams is missing or empty" );
+
+            for ( size_t cells = 0; !enough( diagrams.size(), cells ); )
+            {
+                auto d = all[ diagrams.size() % all.size() ];
+                diagrams.push_back( d );
+                cells += d.size() - std::count( d.begin(), d.end(), U'\n' );
+            }
+        }
+
+        void convert()
+        {
+            for ( auto d : diagrams )
+            {
+                mpost out;
+                pic::convert::scene( pic::reader::read_grid( d ) ).emit( out );
+            }
+        }
+    };
+
+    struct diagrams : corpus
+    {
+        diagrams()
+        {
+            x.type = Axis::Quantitative;
+            x.name = "diagrams";
+            x.min = 200;
+            x.max = 1600;
+            x.log = true;
+            x.step = 2;
+            x.normalize = Axis::Div;
+        }
+
+        std::string describe() { return "category:pic category:corpus type:diagrams"; }
+        bool enough( size_t count, size_t ) { return int( count ) >= p; }
+
+        BENCHMARK(convert) { corpus::convert(); }
+    };
+
+    struct cells : corpus
+    {
+        cells()
+        {
+            x.type = Axis::Quantitative;
+            x.name = "cells";
+            x.unit = "k";
+            x.unit_div = 1000;
+            x.min = 50000;
+            x.max = 400000;
+            x.log = true;
+            x.step = 2;
+            x.normalize = Axis::Div;
+        }
+
+        std::string describe() { return "category:pic category:corpus type:cells"; }
+        bool enough( size_t, size_t cells ) { return int( cells ) >= p; }
+
+        BENCHMARK(convert) { corpus::convert(); }
+    };
+}
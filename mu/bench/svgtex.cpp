@@ -0,0 +1,294 @@
+#define BRICK_BENCHMARK_REG
+
+#include "svgtex.hpp"
+
+#include <brick-benchmark>
+#include <random>
+#include <iostream>
+
+/* Benchmarks of the post-processing of the pages in svgtex, on generated
+ * pages that look like the output of cairo. */
+
+namespace umd::b_svgtex
+{
+    using namespace brick::benchmark;
+
+    /* A page of about ‹size› bytes: 64 glyphs and 8 clip paths in <defs>
+     * (the last 4 of which are clipped by the first 4), then uses of the
+     * glyphs, with a clipped path every now and then. */
+
+    static std::string page( size_t size, unsigned seed = 1 )
+    {
+        std::mt19937 rand( seed );
+        auto num = [&]( int max ) { return std::to_string( rand() % max ); };
+
+        std::string svg = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                          "<svg xmlns=\"http://www.w3.org/2000/svg\" "
+                          "xmlns:xlink=\"http://www.w3.org/1999/xlink\" width=\"400pt\" "
+                          "height=\"600pt\" viewBox=\"0 0 400 600\" version=\"1.1\">\n"
+                          "<defs>\n<g>\n";
+
+        for ( int g = 1; g <= 64; ++ g )
+            svg += "<symbol overflow=\"visible\" id=\"glyph0-" + std::to_string( g ) + "\">\n"
+                   "<path style=\"stroke:none;\" d=\"M " + num( 9 ) + ".5 -" + num( 9 ) + " L " +
+                   num( 9 ) + " -" + num( 9 ) + ".25 C 1 2 3 4 5 6 Z \"/>\n</symbol>\n";
+
+        svg += "</g>\n";
+
+        for ( int c = 1; c <= 8; ++ c )
+            svg += "<clipPath id=\"clip" + std::to_string( c ) + "\">\n"
+                   "  <path " + ( c > 4 ? "clip-path=\"url(#clip" + std::to_string( c - 4 ) + ")\" " : "" ) +
+                   "d=\"M 0 0 L 400 0 L 400 " + num( 600 ) + " L 0 " + num( 600 ) + " Z \"/>\n"
+                   "</clipPath>\n";
+
+        svg += "</defs>\n<g id=\"surface1\">\n";
+
+        while ( svg.size() < size )
+            if ( rand() % 64 == 0 )
+                svg += "<g clip-path=\"url(#clip" + std::to_string( 1 + rand() % 8 ) + ")\" "
+                       "clip-rule=\"nonzero\">\n<path style=\"fill:none;stroke-width:0.4;\" d=\"M " +
+                       num( 400 ) + " " + num( 600 ) + " L " + num( 400 ) + " " + num( 600 ) + " \"/>\n</g>\n";
+            else
+                svg += "  <use xlink:href=\"#glyph0-" + std::to_string( 1 + rand() % 64 ) + "\" x=\"" +
+                       num( 400 ) + "." + num( 100 ) + "\" y=\"" + num( 600 ) + "\"/>\n";
+
+        return svg + "</g>\n</svg>\n";
+    }
+
+    /* The loop that tweak_page replaced: after each match, every pattern is
+     * searched for in the rest of the page (so a pattern that does not occur
+     * is scanned for up to the end, again and again). */
+
+    static std::string tweak_page_multi( std::string_view todo, int docid )
+    {
+        std::string out;
+        std::string_view xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>";
+
+        if ( todo.substr( 0, xml.size() ) == xml )
+            todo.remove_prefix( xml.size() );
+
+        enum class tweak_t { skip, docid };
+
+        std::map< std::string_view, tweak_t > tweak =
+        {
+            { "id=\"clip", tweak_t::docid },
+            { "url(#clip", tweak_t::docid },
+            { "id=\"glyph", tweak_t::docid },
+            { "xlink:href=\"#glyph", tweak_t::docid },
+            { "<page>", tweak_t::skip },
+            { "</page>", tweak_t::skip },
+            { "<pageSet>", tweak_t::skip },
+            { "</pageSet>", tweak_t::skip }
+        };
+
+        while ( !todo.empty() )
+        {
+            std::string_view next;
+            size_t offset = todo.npos;
+            tweak_t apply;
+
+            for ( auto [ str, what ] : tweak )
+                if ( todo.find( str ) < offset )
+                    offset = todo.find( str ), next = str, apply = what;
+
+            if ( next.empty() )
+                break;
+
+            out += todo.substr( 0, offset );
+
+            if ( apply == tweak_t::docid )
+            {
+                out += next;
+                out += "-";
+                out += std::to_string( docid );
+                out += "-";
+            }
+
+            todo.remove_prefix( offset + next.size() );
+        }
+
+        out += todo.substr( 0, todo.size() - 1 );
+        return out;
+    }
+
+    /* Check that tweak_page gives the same result as the old loop, on the
+     * page ‹svg› and on random concatenations of the patterns, their prefixes
+     * and bits of markup. Throws if they differ. */
+
+    static void check_tweak( std::string_view svg, int samples, unsigned seed )
+    {
+        static const std::string_view patterns[] =
+        {
+            "id=\"clip", "url(#clip", "id=\"glyph", "xlink:href=\"#glyph",
+            "<page>", "</page>", "<pageSet>", "</pageSet>",
+            "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+        };
+
+        static const std::string_view filler[] = { "a", " ", "\"", "<", ">", "#", "-", "/", "\n" };
+
+        std::mt19937 rand( seed );
+        std::vector< std::string > inputs = { std::string( svg ) };
+
+        for ( int i = 0; i < samples; ++ i )
+        {
+            std::string s;
+
+            for ( int n = rand() % 40; n > 0; -- n )
+                if ( auto &p = patterns[ rand() % std::size( patterns ) ]; rand() % 2 )
+                    s += p;
+                else if ( rand() % 2 )
+                    s += p.substr( 0, rand() % p.size() );
+                else
+                    s += filler[ rand() % std::size( filler ) ];
+
+            inputs.push_back( s );
+        }
+
+        for ( size_t i = 0; i < inputs.size(); ++ i )
+            if ( tweak_page( inputs[ i ], i ) != tweak_page_multi( inputs[ i ], i ) )
+            {
+                std::cerr << "tweak_page differs from the old loop on:" << std::endl
+                          << inputs[ i ] << std::endl;
+                throw std::logic_error( "tweak_page is not equivalent to the old loop" );
+            }
+    }
+
+    /* Check shared_defs on copies of the same page: the definitions on the
+     * first are moved into the shared block and every later copy uses them
+     * (which needs the references inside the nested clip paths to be
+     * rewritten), and every reference in the output (pages and the block)
+     * is to an id that is defined there. Throws if not. */
+
+    static void check_dedup()
+    {
+        shared_defs shared;
+        std::string out;
+
+        for ( int i = 0; i < 4; ++ i )
+            out += shared.dedup( tweak_page( page( 16 * 1024 ), i ) );
+
+        out += shared.block();
+
+        auto count = [&]( std::string_view s )
+        {
+            int n = 0;
+            for ( size_t at = 0; ( at = out.find( s, at ) ) != out.npos; ++ at )
+                ++ n;
+            return n;
+        };
+
+        if ( count( "<symbol" ) != 64 || count( "<clipPath" ) != 8 )
+            throw std::logic_error( "shared_defs kept a definition more than once" );
+
+        for ( size_t at = 0; ( at = out.find( '#', at ) ) != out.npos; ++ at )
+        {
+            auto ref = std::string_view( out ).substr( at + 1, out.find_first_of( "\")", at ) - at - 1 );
+
+            if ( out.find( " id=\"" + std::string( ref ) + "\"" ) == out.npos )
+            {
+                std::cerr << "shared_defs left a reference to #" << ref << " without a definition" << std::endl;
+                throw std::logic_error( "shared_defs broke a reference" );
+            }
+        }
+    }
+
+    /* tweak_page on pages of 1 to 8 MiB, reported per MiB */
+
+    struct tweak : Group
+    {
+        std::string svg;
+
+        tweak()
+        {
+            x.type = Axis::Quantitative;
+            x.name = "page";
+            x.unit = "MiB";
+            x.min = 1;
+            x.max = 8;
+            x.log = true;
+            x.step = 2;
+            x.normalize = Axis::Div;
+        }
+
+        std::string describe() { return "category:svgtex category:tweak"; }
+
+        void setup( int _p, int _q )
+        {
+            Group::setup( _p, _q );
+            svg = page( p * 1024 * 1024 );
+        }
+
+        BENCHMARK(single) { tweak_page( svg, 1 ); }
+    };
+
+    /* tweak_page against the old loop, which is quadratic in the size of the
+     * page and hence only run on pages of 32 to 256 KiB; reported per KiB.
+     * Before the measurement, the two are checked for equivalence (see
+     * check_tweak) on the page and on 20000 random inputs. */
+
+    struct tweak_multi : Group
+    {
+        std::string svg;
+
+        tweak_multi()
+        {
+            x.type = Axis::Quantitative;
+            x.name = "page";
+            x.unit = "KiB";
+            x.min = 32;
+            x.max = 256;
+            x.log = true;
+            x.step = 2;
+            x.normalize = Axis::Div;
+        }
+
+        std::string describe() { return "category:svgtex category:multi"; }
+
+        void setup( int _p, int _q )
+        {
+            Group::setup( _p, _q );
+            svg = page( p * 1024, p );
+            check_tweak( svg, 20000, p );
+        }
+
+        BENCHMARK(single) { tweak_page( svg, 1 ); }
+        BENCHMARK(multi) { tweak_page_multi( svg, 1 ); }
+    };
+
+    /* shared_defs over 16 to 128 pages of 64 KiB (4 different pages, over
+     * and over), reported per page; setup runs check_dedup first */
+
+    struct defs : Group
+    {
+        std::vector< std::string > pages;
+
+        defs()
+        {
+            x.type = Axis::Quantitative;
+            x.name = "pages";
+            x.min = 16;
+            x.max = 128;
+            x.log = true;
+            x.step = 2;
+            x.normalize = Axis::Div;
+        }
+
+        std::string describe() { return "category:svgtex category:dedup"; }
+
+        void setup( int _p, int _q )
+        {
+            Group::setup( _p, _q );
+            check_dedup();
+
+            for ( int i = 0; i < p; ++ i )
+                pages.push_back( tweak_page( page( 64 * 1024, 1 + i % 4 ), i ) );
+        }
+
+        BENCHMARK(dedup)
+        {
+            shared_defs shared;
+            for ( auto &p : pages )
+                shared.dedup( p );
+        }
+    };
+}
@@ -0,0 +1,175 @@
+#pragma once
+#include "doc/w_html.hpp"
+#include "pic/scene.hpp"
+#include <brick-hash>
+#include <map>
+#include <array>
+#include <vector>
+#include <fstream>
+#include <cstdio>
+#include <stdexcept>
+
+namespace umd::doc
+{
+
+    /* The output of one part of a document that is converted in sections
+     * (see sections.hpp), along with everything that is needed to join it to
+     * the other parts: where the counters that carry over between parts were
+     * printed, and their values at the end of the part (footnotes first, then
+     * w_html::_sections). */
+
+    struct part_output
+    {
+        std::string data;
+        std::vector< w_html::counter_ref > refs;
+        std::array< int, 7 > counters;
+    };
+
+    /* A persistent cache of part_output, keyed by a hash of everything that
+     * the output of a part depends on (the caller provides that). The cache
+     * is loaded from ‹file› when constructed; save() writes back only the
+     * entries that were used (found or inserted) since, so that the file does
+     * not grow as the document is edited. A missing or malformed file is the
+     * same as an empty cache, and so is one written by a converter whose
+     * output is different (the versions follow the magic). */
+
+    struct part_cache
+    {
+        using key = std::pair< uint64_t, uint64_t >;
+        static constexpr std::string_view magic = "mu part cache 2\n";
+        static constexpr std::array< uint32_t, 2 > version = { w_html::output_version,
+                                                               pic::output_version };
+
+        std::string _file;
+        std::map< key, part_output > _stored, _used;
+        bool _dirty = false;
+
+        template< typename... strings_t >
+        static key make_key( const strings_t & ... strings )
+        {
+            brq::hash_state a( 0 ), b( 1 );
+
+            auto add = [&]( auto str )
+            {
+                auto bytes = reinterpret_cast< const uint8_t * >( str.data() );
+                size_t size = str.size() * sizeof( str[ 0 ] );
+
+                for ( auto *s : { &a, &b } )
+                {
+                    s->update_aligned( uint64_t( size ) );
+                    s->realign();
+
+                    for ( size_t done = 0; done < size; done += 1 << 30 )
+                        s->template update_aligned< true >( bytes + done, std::min( size - done, size_t( 1 ) << 30 ) );
+
+                    s->realign();
+                }
+            };
+
+            ( add( std::basic_string_view< typename strings_t::value_type >( strings ) ), ... );
+            return { a.hash(), b.hash() };
+        }
+
+        part_cache( std::string file ) : _file( file )
+        {
+            std::ifstream in( file, std::ios::binary );
+            std::string buf( magic.size(), 0 );
+
+            auto get = [&]( auto &v ) { return bool( in.read( reinterpret_cast< char * >( &v ), sizeof( v ) ) ); };
+            auto file_version = version;
+
+            if ( !in.read( buf.data(), buf.size() ) || buf != magic ||
+                 !get( file_version ) || file_version != version )
+                return;
+
+            auto entry = [&]( part_output &o )
+            {
+                uint32_t refs;
+                uint64_t size;
+
+                if ( !get( o.counters ) || !get( refs ) )
+                    return false;
+
+                o.refs.resize( refs );
+                for ( auto &r : o.refs )
+                    if ( !get( r ) )
+                        return false;
+
+                if ( !get( size ) )
+                    return false;
+
+                o.data.resize( size );
+                return bool( in.read( o.data.data(), size ) );
+            };
+
+            try
+            {
+                for ( key k; get( k ); )
+                    if ( part_output o; entry( o ) )
+                        _stored.emplace( k, std::move( o ) );
+                    else
+                        throw std::runtime_error( "truncated" );
+
+                if ( in.gcount() ) /* a partial key */
+                    throw std::runtime_error( "truncated" );
+            }
+            catch ( const std::exception & ) /* also a bad_alloc from a garbled size */
+            {
+                _stored.clear();
+            }
+        }
+
+        const part_output *find( key k )
+        {
+            if ( auto i = _used.find( k ); i != _used.end() )
+                return &i->second;
+
+            auto i = _stored.find( k );
+            if ( i == _stored.end() )
+                return nullptr;
+
+            auto j = _used.emplace( k, std::move( i->second ) ).first;
+            _stored.erase( i );
+            return &j->second;
+        }
+
+        void insert( key k, part_output o )
+        {
+            _used.insert_or_assign( k, std::move( o ) );
+            _dirty = true;
+        }
+
+        /* write into a temporary file first, so that an interrupted run does
+         * not leave a truncated cache behind; nothing is written if all the
+         * entries were found and used */
+        void save()
+        {
+            if ( !_dirty && _stored.empty() )
+                return;
+
+            std::string tmp = _file + ".tmp";
+            std::ofstream out( tmp, std::ios::binary | std::ios::trunc );
+            auto put = [&]( const auto &v ) { out.write( reinterpret_cast< const char * >( &v ), sizeof( v ) ); };
+
+            out.write( magic.data(), magic.size() );
+            put( version );
+
+            for ( const auto &[ k, o ] : _used )
+            {
+                put( k );
+                put( o.counters );
+                put( uint32_t( o.refs.size() ) );
+                for ( const auto &r : o.refs )
+                    put( r );
+                put( uint64_t( o.data.size() ) );
+                out.write( o.data.data(), o.data.size() );
+            }
+
+            out.close();
+
+            if ( !out || std::rename( tmp.c_str(), _file.c_str() ) )
+                std::remove( tmp.c_str() );
+        }
+    };
+
+}
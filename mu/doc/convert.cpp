@@ -4,37 +4,46 @@
 #include "doc/writer.hpp"
 #include "doc/convert.hpp"
 #include "doc/util.hpp"
+#include "doc/w_html.hpp"
+#include "doc/w_context.hpp"
+#include "doc/w_lnotes.hpp"
+#include "doc/w_slides.hpp"
+#include "doc/w_paper.hpp"
 
 #include <set>
+#include <algorithm>
 #include <sstream>
 #include <iostream>
-#include <codecvt>
 #include <unicode/uchar.h>
 
 namespace umd::doc
 {
 
-    char32_t convert::nonwhite()
+    template< typename writer_t >
+    char32_t convert< writer_t >::nonwhite()
     {
         sv l = todo.top();
         skip_white( l );
         return l.empty() ? 0 : l[ 0 ];
     }
 
-    void convert::skip_white( std::u32string_view &l )
+    template< typename writer_t >
+    void convert< writer_t >::skip_white( std::u32string_view &l )
     {
         while ( !l.empty() && l[0] != U'\n' && space( l ) )
             l.remove_prefix( 1 );
     }
 
-    int convert::white_count( std::u32string_view v )
+    template< typename writer_t >
+    int convert< writer_t >::white_count( std::u32string_view v )
     {
         auto l = v;
         skip_white( l );
         return v.size() - l.size();
     }
 
-    bool convert::skip( char32_t c )
+    template< typename writer_t >
+    bool convert< writer_t >::skip( char32_t c )
     {
         if ( !starts_with( c ) )
             return false;
@@ -42,7 +51,8 @@ namespace umd::doc
         return true;
     }
 
-    int convert::skip_bullet_lead()
+    template< typename writer_t >
+    int convert< writer_t >::skip_bullet_lead()
     {
         int indent = 0;
         bool saw_leader = false;
@@ -62,7 +72,8 @@ namespace umd::doc
         return indent;
     }
 
-    std::pair< int, int > convert::skip_enum_lead()
+    template< typename writer_t >
+    std::pair< int, int > convert< writer_t >::skip_enum_lead()
     {
         int indent = 0;
         int leader = 0;
@@ -99,7 +110,8 @@ namespace umd::doc
         return { indent, first() };
     }
 
-    std::pair< int, int > convert::skip_item_lead( list::type t )
+    template< typename writer_t >
+    std::pair< int, int > convert< writer_t >::skip_item_lead( list::type t )
     {
         switch ( t )
         {
@@ -110,8 +122,11 @@ namespace umd::doc
         __builtin_trap();
     }
 
-    void convert::heading()
+    template< typename writer_t >
+    void convert< writer_t >::heading()
     {
+        probe< profile::heading > _p( _profile );
+
         end_list( -1 );
         int level = 0;
         skip_white();
@@ -143,7 +158,8 @@ namespace umd::doc
         w.heading_stop();
     }
 
-    bool convert::end_list( int count )
+    template< typename writer_t >
+    bool convert< writer_t >::end_list( int count )
     {
         if ( _list.empty() || !count )
             return false;
@@ -162,7 +178,8 @@ namespace umd::doc
         return true;
     }
 
-    void convert::start_list( list::type l, int indent, int first )
+    template< typename writer_t >
+    void convert< writer_t >::start_list( list::type l, int indent, int first )
     {
         switch ( l )
         {
@@ -174,8 +191,11 @@ namespace umd::doc
         _list.emplace( l, indent );
     }
 
-    void convert::ensure_list( int l, list::type t )
+    template< typename writer_t >
+    void convert< writer_t >::ensure_list( int l, list::type t )
     {
+        probe< profile::list > _p( _profile );
+
         while ( int( _list.size() ) > l )
             end_list();
 
@@ -197,25 +217,24 @@ namespace umd::doc
             case list::lettered: w.enum_item(); break;
         }
 
-        std::u32string buf{ fetch_line() };
-        buf += U'\n';
+        std::vector< sv > lines{ fetch_nested( 0 ) };
 
         while ( have_chars() )
         {
             if ( white_count() < indent )
                 break;
 
-            auto l = fetch_line();
-            l.remove_prefix( indent );
-            buf += l;
-            buf += U"\n";
+            lines.push_back( fetch_nested( indent ) );
         }
 
-        recurse( buf );
+        recurse( lines );
     }
 
-    bool convert::try_enum()
+    template< typename writer_t >
+    bool convert< writer_t >::try_enum()
     {
+        probe< profile::list > _p( _profile );
+
         auto l = todo.top();
         skip_white( l );
 
@@ -253,8 +272,8 @@ namespace umd::doc
         return s == span::lref || s == span::gref;
     }
 
-    template< typename flush_t >
-    void convert::span_start( flush_t flush, span s )
+    template< typename writer_t > template< typename flush_t >
+    void convert< writer_t >::span_start( flush_t flush, span s )
     {
         if ( !_spans.empty() && is_ref( _spans.top() ) )
             span_stop( flush, _spans.top() );
@@ -272,8 +291,8 @@ namespace umd::doc
         }
     }
 
-    template< typename flush_t >
-    void convert::span_stop( flush_t flush, span s )
+    template< typename writer_t > template< typename flush_t >
+    void convert< writer_t >::span_stop( flush_t flush, span s )
     {
         if ( is_ref( _spans.top() ) && !is_ref( s ) )
             span_stop( flush, _spans.top() );
@@ -297,9 +316,19 @@ namespace umd::doc
         }
     }
 
-    void convert::emit_text( std::u32string_view v )
+    template< typename writer_t >
+    void convert< writer_t >::emit_text( std::u32string_view v )
     {
-        sv sup = U"¹²³⁴⁵⁶⁷⁸⁹";
+        probe< profile::emit_text > _p( _profile );
+
+        static const charset marks( U"‹›▷▶«»❮❯⟦⟧\u2028\t¹²³⁴⁵⁶⁷⁸⁹" ), ref_marks = marks + U" ";
+
+        /* a space only matters at the end of a reference */
+        auto next = [&]( sv s, size_t i )
+        {
+            bool ref = _spans.size() == 1 && is_ref( _spans.top() );
+            return ( ref ? ref_marks : marks ).next( s, i );
+        };
 
         auto char_cb = [&]( auto flush, char32_t c )
         {
@@ -332,38 +361,39 @@ namespace umd::doc
                         span_stop( flush, _spans.top() );
                     break;
                 default:
-                    if ( !in_math && sup.find( c ) != sup.npos )
+                    if ( !in_math && is_footnote_mark( c ) )
                         emit_footnote( flush, c );
             }
         };
 
-        process( v, char_cb, [&]( auto s ) { w.text( s ); } );
+        process( v, next, char_cb, [&]( auto s ) { w.text( s ); } );
     }
 
-    void convert::try_quote()
+    template< typename writer_t >
+    void convert< writer_t >::try_quote()
     {
-        std::u32string buf;
+        probe< profile::quote > _p( _profile );
+
+        std::vector< sv > lines;
 
         while ( true )
         {
             if ( todo.empty() ) break;
             if ( !starts_with( U'>' ) ) break;
 
-            auto l = fetch_line();
-            l.remove_prefix( std::min( 2lu, l.size() ) );
-            buf += l;
-            buf += U"\n";
+            lines.push_back( fetch_nested( 2 ) );
         }
 
-        if ( !buf.empty() )
+        if ( !lines.empty() )
         {
             w.quote_start();
-            recurse( buf );
+            recurse( lines );
             w.quote_stop();
         }
     }
 
-    auto convert::code_types()
+    template< typename writer_t >
+    auto convert< writer_t >::code_types()
     {
         std::map< std::u32string_view, std::u32string > rv;
         rv[ U"/* C++ */" ] = U"cxx";
@@ -373,8 +403,11 @@ namespace umd::doc
         return rv;
     }
 
-    void convert::emit_code()
+    template< typename writer_t >
+    void convert< writer_t >::emit_code()
     {
+        probe< profile::code > _p( _profile );
+
         for ( int i = 0; i < 4; ++i )
             skip( ' ' );
         auto l = fetch_line();
@@ -396,15 +429,18 @@ namespace umd::doc
         w.code_line( l );
     }
 
-    void convert::end_code()
+    template< typename writer_t >
+    void convert< writer_t >::end_code()
     {
         if ( in_code )
             w.code_stop(), in_code = false;
     }
 
-    template< typename flush_t >
-    void convert::process_footnote( flush_t flush, sv par )
+    template< typename writer_t > template< typename flush_t >
+    void convert< writer_t >::process_footnote( flush_t flush, sv par )
     {
+        probe< profile::footnote > _p( _profile );
+
         w.footnote_head();
         flush();
         w.footnote_start();
@@ -413,7 +449,7 @@ namespace umd::doc
         {
             auto line = fetch( par, newline );
 
-            if ( line.size() >= 1 && sv( U"¹²³⁴⁵⁶⁷⁸⁹" ).find( line[ 0 ] ) != sv::npos )
+            if ( line.size() >= 1 && is_footnote_mark( line[ 0 ] ) )
                 break; /* another footnote → done */
 
             _last_footnote = line;
@@ -423,37 +459,118 @@ namespace umd::doc
         w.footnote_stop();
     }
 
-    template< typename flush_t >
-    void convert::emit_footnote( flush_t flush, char32_t head )
+    std::shared_ptr< convert_base::footnotes > convert_base::index_footnotes( sv text )
     {
-        std::stack< sv > backup;
-
-        while ( todo.size() > 1 )
-            backup.emplace( todo.top() ), todo.pop();
-        checkpoint();
-        skip_to_addr( &*_last_footnote.end() + 1 );
-        while ( skip( U'\n' ) );
+        auto index = std::make_shared< footnotes >();
 
-        while ( have_chars() )
+        while ( !text.empty() )
         {
-            auto par = fetch_par();
-            if ( par.size() >= 2 && par[ 0 ] == head && par[ 1 ] == U' ' )
+            auto par = fetch( text, parbreak ), rest = par;
+
+            while ( !rest.empty() )
             {
-                _footnotes.insert( par.data() );
-                process_footnote( flush, par.substr( 2 ) );
-                break;
+                auto line = fetch( rest, newline );
+                if ( !line.empty() && is_footnote_mark( line[ 0 ] ) )
+                {
+                    sv body( line.data(), par.data() + par.size() - line.data() );
+                    index->push_back( { body, line.data() == par.data() } );
+                }
             }
-            else if ( sv( U"¹²³⁴⁵⁶⁷⁸⁹" ).find( par[ 0 ] ) != sv::npos )
-                break; /* mismatch → not a footnote */
         }
 
-        restore();
-        while ( backup.size() )
-            todo.emplace( backup.top() ), backup.pop();
+        int next = index->size();
+
+        for ( int i = index->size() - 1; i >= 0; -- i )
+        {
+            ( *index )[ i ].next = next;
+            if ( ( *index )[ i ].par_start )
+                next = i;
+        }
+
+        return index;
     }
 
-    void convert::try_picture()
+    /* the first entry at or after ‹pos› */
+    template< typename writer_t >
+    convert_base::footnote *convert< writer_t >::find_footnote( const char32_t *pos )
     {
+        auto before = []( const footnote &f, const char32_t *p )
+        {
+            return std::less<>()( f.par.data(), p );
+        };
+
+        auto &index = *_footnotes;
+        auto i = std::lower_bound( index.begin(), index.end(), pos, before );
+        return index.data() + ( i - index.begin() );
+    }
+
+    /* is todo.top() at the body of a footnote that was already emitted? the
+     * bodies are only looked for in the top-level text */
+    template< typename writer_t >
+    bool convert< writer_t >::at_used_footnote()
+    {
+        auto &t = todo.top();
+
+        if ( t._lines || t.empty() || !is_footnote_mark( t[ 0 ] ) )
+            return false;
+
+        auto fn = find_footnote( t.data() );
+        auto end = _footnotes->data() + _footnotes->size();
+        return fn != end && fn->par.data() == t.data() && fn->used;
+    }
+
+    /* The body of a footnote is the first paragraph that starts with a
+     * footnote mark, looking from the current top-level position (or from the
+     * end of the previous footnote body, whichever comes later). If the mark
+     * does not match ‹head›, the reference has no body. */
+
+    template< typename writer_t > template< typename flush_t >
+    void convert< writer_t >::emit_footnote( flush_t flush, char32_t head )
+    {
+        sv text = todo.bottom();
+
+        /* null once the text of the last body is gone (see doc/reader.hpp) */
+        if ( _last_footnote.data() )
+            if ( const char32_t *from = &*_last_footnote.end() + 1; from > text.data() )
+                text.remove_prefix( std::min( size_t( from - text.data() ), text.size() ) );
+        while ( !text.empty() && text[ 0 ] == U'\n' )
+            text.remove_prefix( 1 );
+
+        footnote *end = _footnotes->data() + _footnotes->size(), *fn = find_footnote( text.data() );
+        sv par;
+
+        if ( !text.empty() && is_footnote_mark( text[ 0 ] ) ) /* the search starts at a mark */
+        {
+            par = fetch( text, parbreak );
+            if ( fn == end || fn->par.data() != par.data() )
+                fn = nullptr;
+        }
+        else
+        {
+            if ( fn != end && !fn->par_start )
+                fn = _footnotes->data() + fn->next;
+            if ( fn == end || fn->par.data() >= text.data() + text.size() )
+                _open_footnote = true;
+            if ( fn == end )
+                return;
+            par = fn->par;
+        }
+
+        if ( par.size() >= 2 && par[ 0 ] == head && par[ 1 ] == U' ' )
+        {
+            if ( fn && fn->par.data() >= text.data() + text.size() )
+                return void( _foreign_footnote = true );
+            if ( fn )
+                fn->used = true;
+            process_footnote( flush, par.substr( 2 ) );
+        }
+    }
+
+    template< typename writer_t >
+    void convert< writer_t >::try_picture()
+    {
+        probe< profile::picture > _p( _profile );
+
         if ( !white_count() )
             return;
 
@@ -468,15 +585,49 @@ namespace umd::doc
 
         if ( !special ) return;
 
+        /* the picture extends to an empty line, which in a nested block is
+         * further than the current line: join the lines up to there */
+        std::u32string joined;
+
+        if ( chk._lines )
+        {
+            joined = chk;
+            for ( size_t l = chk._next; l < chk._lines->size(); ++l )
+                if ( joined += ( *chk._lines )[ l ]; ( *chk._lines )[ l ] == U"\n" )
+                    break;
+            static_cast< sv & >( chk ) = joined;
+        }
+
         for ( ; i < int( chk.size() ) - 1 && ( chk[ i ] != '\n' || chk[ i + 1 ] != '\n' ) ; ++ i );
 
+        if ( w.svg_pictures() && picture_svg( chk.substr( 0, i ) ) )
+        {
+            shift( i );
+            return;
+        }
+
         w.mpost_start();
 
         try
         {
-            auto grid = pic::reader::read_grid( peek( i ) );
-            auto scene = pic::convert::scene( grid );
-            scene.emit( *this );
+            auto text = chk.substr( 0, i );
+
+            if ( auto cached = _pic_cache ? _pic_cache->find( text ) : nullptr )
+                cached->replay( *this );
+            else if ( _pic_cache )
+            {
+                pic::recording rec;
+                auto grid = pic::reader::read_grid( text );
+                pic::convert::scene( grid ).emit( rec );
+                rec.replay( *this );
+                _pic_cache->insert( text, std::move( rec ) );
+            }
+            else
+            {
+                auto grid = pic::reader::read_grid( text );
+                auto scene = pic::convert::scene( grid );
+                scene.emit( *this );
+            }
         }
         catch ( const pic::bad_picture &bp )
         {
@@ -490,28 +641,68 @@ namespace umd::doc
         shift( i );
     }
 
-    bool convert::try_dispmath()
+    /* Draw a picture as svg, unless its labels need TeX (for math), or it
+     * cannot be converted at all: it then goes through metapost as usual,
+     * which also reports the error. */
+
+    template< typename writer_t >
+    bool convert< writer_t >::picture_svg( sv text )
     {
-        auto for_index = []( auto l, int w, auto f )
+        if ( text.find( U'⟦' ) != text.npos )
+            return false;
+
+        pic::group scene;
+
+        try
+        {
+            scene = pic::convert::scene( pic::reader::read_grid( text ) );
+        }
+        catch ( const pic::bad_picture & )
         {
-            int idx = 0;
-            for ( int i = 0; i < int( l.size() ); ++i )
+            return false;
+        }
+
+        w.svg_start();
+        scene.svg( *this );
+        w.svg_stop();
+        return true;
+    }
+
+    template< typename writer_t >
+    bool convert< writer_t >::try_dispmath()
+    {
+        probe< profile::dispmath > _p( _profile );
+
+        /* Columns are counted in characters, i.e. combining marks do not
+         * count. ‹idx[ i ]› is the column of the code point at offset ‹i›
+         * (counting from 1, or 0 for combining marks at the start of a line)
+         * and ‹last[ c ]› is the offset of the last code point in column ‹c›
+         * (-1 if there is none). */
+
+        struct index
+        {
+            std::vector< int > idx, last;
+
+            index( sv l ) : idx( l.size() )
             {
-                if ( !u_getCombiningClass( l[ i ] ) ) ++idx;
-                f( idx, l.substr( i, i + w ) );
+                int c = 0;
+
+                for ( size_t i = 0; i < l.size(); ++i )
+                    idx[ i ] = u_getCombiningClass( l[ i ] ) ? c : ++c;
+
+                last.resize( c + 1, -1 );
+                for ( size_t i = 0; i < l.size(); ++i )
+                    last[ idx[ i ] ] = i;
             }
-        };
 
-        auto substr = []( auto l, size_t from, size_t to )
-        {
-            size_t f = 0, t = l.npos, idx = 0;
-            for ( int i = 0; i < int( l.size() ); ++i )
+            /* the text from the last code point of column ‹from› up to the
+             * last code point of column ‹to› */
+            sv substr( sv l, size_t from, size_t to ) const
             {
-                if ( !u_getCombiningClass( l[ i ] ) ) ++idx;
-                if ( idx == from ) f = i;
-                if ( idx == to ) t = i;
+                auto at = [&]( size_t c, size_t def ) { return c < last.size() && last[ c ] >= 0 ? last[ c ] : def; };
+                size_t f = at( from, 0 ), t = at( to, l.npos );
+                return l.substr( f, t - f );
             }
-            return l.substr( f, t - f );
         };
 
         if ( white_count() > 0 && white_count() <= 3 && nonwhite() == U'⟦' )
@@ -535,34 +726,40 @@ namespace umd::doc
 
             lines.back().remove_suffix( 1 );
 
+            std::vector< index > idx( lines.begin(), lines.end() );
             std::set< int > align;
 
-            auto align_on = [&]( std::u32string_view find )
+            /* Align on a column if an operator of one of the classes is
+             * surrounded by spaces there on every line that reaches that
+             * far (and there is at least one such line). The column of a
+             * match is that of the space before the operator, plus one. */
+
+            if ( lines.size() > 1 )
             {
-                std::set< int > a;
+                const sv classes[] = { U"=", U"→←", U"+-⋅/" };
+                std::vector< uint8_t > seen[ 3 ]; /* bit 0: matched, bit 1: did not match */
 
-                auto per_line = [&]( auto f )
+                for ( size_t n = 0; n < lines.size(); ++n )
                 {
-                    for ( auto l : lines )
-                        for_index( l, 3, f );
-                };
+                    auto l = lines[ n ];
 
-                auto match = [&]( auto w )
-                {
-                    return w[ 0 ] == U' ' && w[ 2 ] == U' ' && find.find( w[ 1 ] ) != find.npos;
-                };
+                    for ( auto &s : seen )
+                        s.resize( std::max( s.size(), idx[ n ].last.size() + 1 ) );
 
-                per_line( [&]( int idx, auto w ) { if (  match( w ) ) a.insert( idx + 1 ); } );
-                per_line( [&]( int idx, auto w ) { if ( !match( w ) ) a.erase( idx + 1 ); } );
-                for ( int i : a )
-                    align.insert( i );
-            };
+                    for ( size_t i = 0; i < l.size(); ++i )
+                    {
+                        bool spaced = i + 2 < l.size() && l[ i ] == U' ' && l[ i + 2 ] == U' ';
 
-            if ( lines.size() > 1 )
-            {
-                align_on( U"=" );
-                align_on( U"→←" );
-                align_on( U"+-⋅/" );
+                        for ( int c = 0; c < 3; ++c )
+                            seen[ c ][ idx[ n ].idx[ i ] + 1 ] |=
+                                spaced && classes[ c ].find( l[ i + 1 ] ) != sv::npos ? 1 : 2;
+                    }
+                }
+
+                for ( auto &s : seen )
+                    for ( size_t c = 0; c < s.size(); ++c )
+                        if ( s[ c ] == 1 )
+                            align.insert( c );
             }
 
             std::string astr;
@@ -572,20 +769,21 @@ namespace umd::doc
 
             w.eqn_start( 2 * align.size() + 1, astr );
 
-            for ( auto l : lines )
+            for ( size_t n = 0; n < lines.size(); ++n )
             {
+                auto l = lines[ n ];
                 int last = 0;
                 for ( int i : align )
                     if ( i < int( l.size() ) )
                     {
                         w.eqn_new_cell();
-                        w.text( substr( l, last, i ) );
+                        w.text( idx[ n ].substr( l, last, i ) );
                         w.eqn_new_cell();
-                        w.text( substr( l, i, i + 1 ) );
+                        w.text( idx[ n ].substr( l, i, i + 1 ) );
                         last = i + 1;
                     }
                 w.eqn_new_cell();
-                w.text( substr( l, last, l.npos ) );
+                w.text( idx[ n ].substr( l, last, l.npos ) );
                 w.eqn_new_row();
             }
             w.eqn_stop();
@@ -595,8 +793,11 @@ namespace umd::doc
         return false;
     }
 
-    void convert::try_table()
+    template< typename writer_t >
+    void convert< writer_t >::try_table()
     {
+        probe< profile::table > _p( _profile );
+
         auto backup = todo;
         auto revert = [&]{ todo = backup; };
 
@@ -713,42 +914,68 @@ namespace umd::doc
         w.table_stop();
     }
 
-    void convert::recurse( const std::u32string &buf )
+    /* Fetch a line of a nested block (a list item, a quote or a nested
+     * block), less the first ‹strip› characters. The result is a view of the
+     * rest of the line along with its newline, i.e. a line of the cursor that
+     * recurse builds. Only a line that does not end with a newline (the last
+     * line of the document) is copied, to add one. */
+
+    template< typename writer_t >
+    convert_base::sv convert< writer_t >::fetch_nested( size_t strip )
+    {
+        sv t = todo.top();
+        auto l = fetch_line();
+        bool eol = t.size() > l.size() && t[ l.size() ] == U'\n';
+
+        l.remove_prefix( std::min( strip, l.size() ) );
+
+        if ( eol )
+            return sv( l.data(), l.size() + 1 );
+
+        _unterminated.emplace_back( l );
+        return _unterminated.back() += U'\n';
+    }
+
+    template< typename writer_t >
+    void convert< writer_t >::recurse( const std::vector< sv > &lines )
     {
         int ldepth = rec_list_depth;
         rec_list_depth = _list.size();
-        todo.emplace( buf );
+        todo.emplace( lines );
         body();
         end_list( _list.size() - rec_list_depth );
         todo.pop();
         rec_list_depth = ldepth;
     }
 
-    void convert::try_nested()
+    template< typename writer_t >
+    void convert< writer_t >::try_nested()
     {
-        std::u32string buf;
+        probe< profile::nested > _p( _profile );
+
+        std::vector< sv > lines;
 
         while ( true )
         {
             if ( todo.empty() ) break;
             if ( !starts_with( U'│' ) ) break;
 
-            auto l = fetch_line();
-            l.remove_prefix( std::min( 2lu, l.size() ) ); /* strip │ and a space */
-            buf += l;
-            buf += U"\n";
+            lines.push_back( fetch_nested( 2 ) ); /* strip │ and a space */
         }
 
-        if ( !buf.empty() )
+        if ( !lines.empty() )
         {
             w.nest_start();
-            recurse( buf );
+            recurse( lines );
             w.nest_end();
         }
     }
 
-    bool convert::try_directive()
+    template< typename writer_t >
+    bool convert< writer_t >::try_directive()
     {
+        probe< profile::directive > _p( _profile );
+
         if ( starts_with( U"$$raw_mpost" ) )
         {
             w.mpost_start();
@@ -778,10 +1005,16 @@ namespace umd::doc
         return false;
     }
 
-    void convert::body()
+    /* Dispatch a single block (or a single line of running text) at the
+     * start of todo.top(). Returns false once the input is exhausted. The
+     * order of the checks below is significant: e.g. tables and display math
+     * must be tried before pictures, and code blocks before lists. */
+
+    template< typename writer_t >
+    bool convert< writer_t >::block()
     {
         if ( try_directive() )
-            body();
+            return true;
 
         try_table();
 
@@ -796,30 +1029,30 @@ namespace umd::doc
         if ( todo.empty() )
         {
             end_code();
-            return;
+            return false;
         }
 
         if ( !in_code && _list.empty() && starts_with( U'\n' ) )
-            return w.paragraph(), fetch_line(), body();
+            return w.paragraph(), fetch_line(), true;
 
         for ( auto c : U"┄" )
             if ( starts_with( std::u32string( 40, c ) ) )
                 fetch_line(), w.hrule( c );
 
-        if ( _footnotes.count( todo.top().data() ) )
-            return fetch_par(), body();
+        if ( at_used_footnote() )
+            return fetch_par(), true;
 
         if ( starts_with( U'' ) )
-            return end_list( -1 ), w.pagebreak(), fetch_line(), body();
+            return end_list( -1 ), w.pagebreak(), fetch_line(), true;
 
         if ( white_count() >= 4 )
-            return emit_code(), body();
+            return emit_code(), true;
         else
             end_code();
 
         switch ( nonwhite() )
         {
-            case 0: return;
+            case 0: return false;
             case U'•': ensure_list( 1, list::bullets ); break;
             case U'◦': ensure_list( 2, list::bullets ); break;
             case U'‣': ensure_list( 3, list::bullets ); break;
@@ -835,10 +1068,21 @@ namespace umd::doc
                 }
         }
 
-        body();
+        return true;
     }
 
-    void convert::header()
+    /* The main loop: consumes blocks until the current input is exhausted.
+     * This used to be (tail-)recursive, which made the stack depth
+     * proportional to the number of lines in the document. */
+
+    template< typename writer_t >
+    void convert< writer_t >::body()
+    {
+        while ( block() );
+    }
+
+    template< typename writer_t >
+    void convert< writer_t >::header()
     {
         if ( !starts_with( U':' ) )
             return w.meta_end();
@@ -859,7 +1103,8 @@ namespace umd::doc
         header();
     }
 
-    void convert::run()
+    template< typename writer_t >
+    void convert< writer_t >::run()
     {
         header();
         body();
@@ -867,4 +1112,11 @@ namespace umd::doc
         w.end();
     }
 
+    template struct convert< writer >;
+    template struct convert< w_html >;
+    template struct convert< w_context >;
+    template struct convert< w_lnotes >;
+    template struct convert< w_slides >;
+    template struct convert< w_paper >;
+
 }
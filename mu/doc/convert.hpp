@@ -1,9 +1,13 @@
 #pragma once
 #include "doc/writer.hpp"
 #include "pic/writer.hpp"
+#include "pic/cache.hpp"
+#include "doc/profile.hpp"
 #include <string_view>
 #include <stack>
-#include <set>
+#include <vector>
+#include <deque>
+#include <memory>
 #include <cassert>
 #include <brick-min>
 
@@ -11,8 +15,7 @@ namespace umd::doc
 {
     static inline int stoi( std::u32string_view n )
     {
-        std::wstring_convert< std::codecvt_utf8< char32_t >, char32_t > conv;
-        return std::stoi( conv.to_bytes( n.begin(), n.end() ) );
+        return std::stoi( to_utf8( n ) );
     }
 
     enum class span
@@ -32,19 +35,114 @@ namespace umd::doc
         }
     }
 
-    struct convert : pic::writer
+    /* The parts of the converter that do not depend on the writer. */
+
+    struct convert_base
     {
         using sv = std::u32string_view;
 
-        doc::writer &w;
-        std::stack< sv > todo;
+        /* The text at one level of the stack. In nested blocks (see recurse),
+         * the text is not contiguous: it is a sequence of lines, each a view
+         * of the rest of a line of the enclosing text (along with its
+         * newline). The view itself is then the rest of the current line,
+         * and once that is used up, the cursor moves on to the next one. */
+
+        struct cursor : sv
+        {
+            const std::vector< sv > *_lines = nullptr;
+            size_t _next = 0;
+
+            cursor( sv s = sv() ) : sv( s ) {}
+            cursor( const std::vector< sv > &lines ) : _lines( &lines ) { advance(); }
+
+            void advance()
+            {
+                if ( empty() && _lines && _next < _lines->size() )
+                    static_cast< sv & >( *this ) = ( *_lines )[ _next ++ ];
+            }
+        };
+
+        /* the bottom of the stack is the top-level document text */
+        struct stack : std::stack< cursor >
+        {
+            cursor &bottom() { return c.front(); }
+        };
+
+        /* Every line of the input that starts with a footnote mark, in
+         * document order. Built once up front, so that looking up the body of
+         * a footnote is a binary search instead of a rescan of the text that
+         * follows the reference. The ‹par› of each entry extends from the
+         * mark to the end of the enclosing paragraph, and ‹next› is the index
+         * of the next entry that starts a paragraph of its own. The index
+         * can be shared by converters that each process a part of the same
+         * document (see doc/sections.hpp). */
+
+        struct footnote
+        {
+            sv par;
+            bool par_start, used = false;
+            int next = -1;
+        };
+
+        using footnotes = std::vector< footnote >;
+
+        static std::shared_ptr< footnotes > index_footnotes( sv text );
+
+        static bool is_footnote_mark( char32_t c )
+        {
+            return sv( U"¹²³⁴⁵⁶⁷⁸⁹" ).find( c ) != sv::npos;
+        }
+
+        template< typename F >
+        static std::u32string_view fetch( std::u32string_view &v, F pred )
+        {
+            auto l = v;
+            while ( !v.empty() && !pred( v ) )
+                v.remove_prefix( 1 );
+            if ( !v.empty() )
+                v.remove_prefix( pred( v ) );
+            return l.substr( 0, l.size() - v.size() - 1 );
+        }
+
+        static int count( sv s, char32_t ch )
+        {
+            int count = 0;
+            while ( !s.empty() && s[ 0 ] == ch )
+                s.remove_prefix( 1 ), ++ count;
+            return count;
+        }
+
+        static int newline( sv s )  { return s[ 0 ] == U'\n'; }
+        static int space( sv s )    { return s[ 0 ] == U' ' || s[ 0 ] == U'\n'; }
+        static int parbreak( sv s ) { int c = count( s, U'\n' ); return c >= 2 ? c : 0; }
+    };
+
+    /* The converter is a template over the type of the writer, so that the
+     * calls into a ‹final› writer are direct (and can be inlined). Over the
+     * abstract doc::writer, i.e. convert<>, the calls are virtual: this is
+     * the instance for writers without one of their own (w_noop, the
+     * profiling writer and w_doctype in main.cpp). The instances are
+     * compiled in convert.cpp (see the list below). */
+
+    template< typename writer_t = doc::writer >
+    struct convert : convert_base, pic::writer, pic::svg_writer
+    {
+        writer_t &w;
+        stack todo;
+
+        /* When the footnote index is shared by the converters of the parts
+         * of a document, _foreign_footnote is set when a footnote body is
+         * found outside of the part, and _open_footnote when the search for
+         * a body went past the end of the part (i.e. the result depends on
+         * the text that follows). */
 
         std::stack< span > _spans;
-        std::set< const char32_t * > _footnotes;
+        std::shared_ptr< footnotes > _footnotes;
         sv _last_footnote;
+        bool _foreign_footnote = false, _open_footnote = false;
 
-        convert( sv t, doc::writer &w )
-            : w( w ), _last_footnote( t.substr( 0, 0 ) )
+        convert( sv t, writer_t &w, std::shared_ptr< footnotes > fn = nullptr )
+            : w( w ), _footnotes( fn ? fn : index_footnotes( t ) ), _last_footnote( t.substr( 0, 0 ) )
         {
             todo.emplace( t );
         }
@@ -59,6 +157,13 @@ namespace umd::doc
         std::stack< list > _list;
 
         int rec_list_depth = 0;
+        std::deque< std::u32string > _unterminated; /* see fetch_nested */
+
+        pic::cache *_pic_cache = nullptr;
+        w_profile *_profile = nullptr; /* when profiling, the writer */
+
+        template< profile::stage s >
+        using probe = w_profile::probe< s >;
 
         bool in_picture = false;
         bool in_code = false;
@@ -69,6 +174,8 @@ namespace umd::doc
 
         void emit_mpost( std::string_view s ) { w.mpost_write( s ); }
         void emit_tex( std::u32string_view s ) { emit_text( s ); }
+        void emit_svg( std::string_view s ) { w.svg_write( s ); }
+        void emit_label( std::u32string_view s ) { emit_text( s ); }
 
         char32_t nonwhite();
         void skip_white( std::u32string_view &l );
@@ -79,55 +186,46 @@ namespace umd::doc
         void skip_white() { skip_white( todo.top() ); }
         bool skip( char32_t c );
 
-        void skip_to_addr( const char32_t *a )
-        {
-            if ( a > todo.top().data() )
-                shift( a - todo.top().data() );
-        }
-
         std::pair< int, int > skip_item_lead( list::type );
         int skip_bullet_lead();
         std::pair< int, int > skip_enum_lead();
 
         template< typename F >
-        std::u32string_view fetch( std::u32string_view &v, F pred )
+        std::u32string_view fetch_top( F pred )
         {
-            auto l = v;
-            while ( !v.empty() && !pred( v ) )
-                v.remove_prefix( 1 );
-            if ( !v.empty() )
-                v.remove_prefix( pred( v ) );
-            return l.substr( 0, l.size() - v.size() - 1 );
+            auto rv = fetch( todo.top(), pred );
+            todo.top().advance();
+            return rv;
         }
 
-        static int count( sv s, char32_t ch )
-        {
-            int count = 0;
-            while ( !s.empty() && s[ 0 ] == ch )
-                s.remove_prefix( 1 ), ++ count;
-            return count;
-        }
-
-        static int newline( sv s )  { return s[ 0 ] == U'\n'; }
-        static int space( sv s )    { return s[ 0 ] == U' ' || s[ 0 ] == U'\n'; }
-        static int parbreak( sv s ) { int c = count( s, U'\n' ); return c >= 2 ? c : 0; }
-
-        std::u32string_view fetch_line() { return fetch( todo.top(), newline ); }
-        std::u32string_view fetch_word() { return fetch( todo.top(), space ); }
-        std::u32string_view fetch_par()  { return fetch( todo.top(), parbreak ); }
+        std::u32string_view fetch_line() { return fetch_top( newline ); }
+        std::u32string_view fetch_word() { return fetch_top( space ); }
+        std::u32string_view fetch_par()  { return fetch_top( parbreak ); }
+        sv fetch_nested( size_t strip );
 
         bool starts_with( char32_t c ) const { return !todo.top().empty() && todo.top()[ 0 ] == c; }
         bool starts_with( sv s ) const { return todo.top().substr( 0, s.size() ) == s; }
         sv peek( int c ) const { return todo.top().substr( 0, c ); }
         char32_t peek() const { assert( !todo.top().empty() ); return todo.top()[ 0 ]; }
-        sv shift( int c = 1 ) { sv res = peek( c ); todo.top().remove_prefix( c ); return res; }
-        bool have_chars( int c = 1 ) { return todo.top().size() >= c; }
+        sv shift( int c = 1 )
+        {
+            sv res = peek( c );
 
-        void checkpoint() { todo.emplace( todo.top() ); }
-        void restore() { todo.pop(); }
+            for ( auto &t = todo.top(); c > 0 && !t.empty(); t.advance() )
+            {
+                int n = std::min( size_t( c ), t.size() );
+                t.remove_prefix( n ), c -= n;
+            }
+
+            return res;
+        }
+        bool have_chars( int c = 1 ) { return todo.top().size() >= c; }
 
         void emit_text( std::u32string_view v );
 
+        footnote *find_footnote( const char32_t *pos );
+        bool at_used_footnote();
+
         template< typename flush_t > void process_footnote( flush_t, sv par );
         template< typename flush_t > void emit_footnote( flush_t, char32_t head );
 
@@ -148,17 +246,32 @@ namespace umd::doc
         void end_code();
 
         void try_picture();
+        bool picture_svg( sv text );
         void try_table();
         bool try_dispmath();
         void try_nested();
         bool try_directive();
         void try_quote();
 
-        void recurse( const std::u32string &data );
+        void recurse( const std::vector< sv > &lines );
 
         void header();
+        bool block();
         void body();
         void run();
     };
 
+    struct w_html;
+    struct w_context;
+    struct w_lnotes;
+    struct w_slides;
+    struct w_paper;
+
+    extern template struct convert< writer >;
+    extern template struct convert< w_html >;
+    extern template struct convert< w_context >;
+    extern template struct convert< w_lnotes >;
+    extern template struct convert< w_slides >;
+    extern template struct convert< w_paper >;
+
 }
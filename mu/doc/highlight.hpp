@@ -0,0 +1,196 @@
+#pragma once
+#include "util.hpp"
+#include <string_view>
+#include <vector>
+#include <algorithm>
+
+namespace umd::doc::highlight
+{
+    using sv = std::u32string_view;
+
+    /* The token classes of the ConTeXt visualizers (tex/syn-*.lua), which
+     * this lexer mirrors for the HTML writer. */
+
+    enum class token { plain, name, keyword, type, magic, comment, string, quote, op };
+
+    /* The syntax of a language, as far as highlighting is concerned. Names
+     * are runs of letters and underscores (followed by letters and digits if
+     * ‹name_digits› is set); each name is classified by the word lists. */
+
+    struct language
+    {
+        sv line_comment = {};
+        bool block_comment = false, single_quote = false, name_digits = false, dunder = false;
+        sv magic = {};
+        std::vector< sv > keywords = {}, types = {}, word_ops = {}, word_magic = {};
+        sv label = {}; /* a keyword that is not a name */
+
+        token classify( sv word ) const
+        {
+            auto in = []( const auto &list, sv w ) { return std::find( list.begin(), list.end(), w ) != list.end(); };
+
+            if ( in( keywords, word ) ) return token::keyword;
+            if ( in( types, word ) )    return token::type;
+            if ( in( word_ops, word ) ) return token::op;
+            if ( in( word_magic, word ) ) return token::magic;
+            return token::name;
+        }
+    };
+
+    static inline const language *find( sv name )
+    {
+        static const language cxx
+        {
+            .line_comment = U"//", .block_comment = true, .single_quote = true, .magic = U"#@",
+            .keywords = { U"auto", U"struct", U"class", U"try", U"catch", U"if", U"else", U"break",
+                          U"goto", U"new", U"delete", U"true", U"false", U"while", U"for",
+                          U"continue", U"enum", U"switch", U"case", U"protected", U"private",
+                          U"return", U"const", U"volatile", U"template", U"typename", U"using",
+                          U"sizeof" },
+            .types = { U"int", U"double", U"void", U"short", U"long", U"char", U"size_t",
+                       U"ssize_t", U"time_t" }
+        };
+
+        static const language shell
+        {
+            .line_comment = U"#", .single_quote = true, .magic = U"#@",
+            .keywords = { U"if", U"then", U"else", U"fi", U"while", U"do", U"done", U"for",
+                          U"continue", U"case", U"esac" },
+            .types = { U"echo", U"cat", U"head", U"tail", U"ls", U"sed", U"rm", U"rmdir", U"cp",
+                       U"man", U"mkdir", U"cd", U"touch", U"pwd" }
+        };
+
+        static const language python
+        {
+            .line_comment = U"#", .single_quote = true, .dunder = true,
+            .keywords = { U"try", U"except", U"if", U"else", U"elif", U"while", U"for", U"in",
+                          U"continue", U"break", U"return", U"assert", U"from", U"import", U"def",
+                          U"class", U"pass", U"yield", U"await", U"raise", U"lambda", U"finally",
+                          U"with", U"as" },
+            .types = { U"int", U"float", U"str", U"bool", U"None", U"list", U"dict", U"set",
+                       U"range", U"Optional", U"List", U"Tuple", U"Set", U"Dict", U"True",
+                       U"False" },
+            .word_ops = { U"and", U"or", U"not", U"is" },
+            .word_magic = { U"len", U"chr", U"ord", U"self", U"sorted" }
+        };
+
+        static const language llvm
+        {
+            .line_comment = U"//", .block_comment = true, .name_digits = true, .magic = U"@%",
+            .keywords = { U"icmp", U"load", U"store", U"br", U"add" },
+            .types = { U"i32", U"i1" },
+            .label = U"<label>"
+        };
+
+        if ( name == U"cxx" )    return &cxx;
+        if ( name == U"shell" )  return &shell;
+        if ( name == U"python" ) return &python;
+        if ( name == U"llvm" )   return &llvm;
+        return nullptr;
+    }
+
+    /* Splits the lines of a code block into tokens. The only state carried
+     * from line to line is an open block comment; unlike in the visualizers,
+     * a string must be closed on the line where it starts (otherwise the
+     * quote is an ordinary character). */
+
+    struct lexer
+    {
+        const language &lang;
+        bool in_comment = false;
+
+        lexer( const language &l ) : lang( l ) {}
+
+        static bool letter( char32_t c ) { return ( c | 0x20 ) >= U'a' && ( c | 0x20 ) <= U'z'; }
+        static bool digit( char32_t c ) { return c >= U'0' && c <= U'9'; }
+
+        /* call emit( token, text ) for each token of ‹l›, in order */
+        template< typename emit_t >
+        void line( sv l, emit_t emit )
+        {
+            size_t i = 0, plain = 0;
+
+            auto tok = [&]( token t, size_t n )
+            {
+                if ( plain < i )
+                    emit( token::plain, l.substr( plain, i - plain ) );
+                if ( n )
+                    emit( t, l.substr( i, n ) );
+                plain = i += n;
+            };
+
+            auto dunder = [&]( sv s ) -> size_t /* __letters__ */
+            {
+                size_t n = 2;
+                if ( !starts_with( s, sv( U"__" ) ) )
+                    return 0;
+                while ( n < s.size() && letter( s[ n ] ) )
+                    ++ n;
+                return n > 2 && s.substr( n, 2 ) == U"__" ? n + 2 : 0;
+            };
+
+            if ( in_comment )
+            {
+                auto end = l.find( U"*/" );
+                in_comment = end == l.npos;
+                tok( token::comment, in_comment ? l.size() : end + 2 );
+            }
+
+            while ( i < l.size() )
+            {
+                auto rest = l.substr( i );
+                char32_t c = rest[ 0 ];
+
+                if ( !lang.line_comment.empty() && starts_with( rest, lang.line_comment ) )
+                    tok( token::comment, rest.size() );
+                else if ( lang.block_comment && starts_with( rest, sv( U"/*" ) ) )
+                {
+                    auto end = rest.find( U"*/", 2 );
+                    in_comment = end == rest.npos;
+                    tok( token::comment, in_comment ? rest.size() : end + 2 );
+                }
+                else if ( c == U'"' && rest.find( c, 1 ) != rest.npos )
+                    tok( token::quote, 1 ), tok( token::string, rest.find( c, 1 ) - 1 ), tok( token::quote, 1 );
+                else if ( c == U'\'' && lang.single_quote && rest.find( c, 1 ) != rest.npos )
+                    tok( token::string, rest.find( c, 1 ) + 1 );
+                else if ( size_t n = lang.dunder ? dunder( rest ) : 0 )
+                    tok( token::magic, n );
+                else if ( letter( c ) || c == U'_' )
+                {
+                    size_t n = 1;
+                    while ( n < rest.size() && ( letter( rest[ n ] ) || rest[ n ] == U'_' ) )
+                        ++ n;
+                    while ( lang.name_digits && n < rest.size() && ( letter( rest[ n ] ) || digit( rest[ n ] ) ) )
+                        ++ n;
+                    tok( lang.classify( rest.substr( 0, n ) ), n );
+                }
+                else if ( !lang.label.empty() && starts_with( rest, lang.label ) )
+                    tok( token::keyword, lang.label.size() );
+                else if ( lang.magic.find( c ) != sv::npos )
+                    tok( token::magic, 1 );
+                else
+                    ++ i; /* operators, punctuation and white space */
+            }
+
+            tok( token::plain, 0 );
+        }
+    };
+
+    /* the opening tag of a token in HTML, in terms of the highlight.js
+     * classes (which common.css provides styles for); empty if the token is
+     * not marked up */
+
+    static inline sv html_tag( token t )
+    {
+        switch ( t )
+        {
+            case token::keyword: return U"<span class=\"hljs-keyword\">";
+            case token::type:    return U"<span class=\"hljs-type\">";
+            case token::magic:   return U"<span class=\"hljs-meta\">";
+            case token::comment: return U"<span class=\"hljs-comment\">";
+            case token::string:
+            case token::quote:   return U"<span class=\"hljs-string\">";
+            default:             return U"";
+        }
+    }
+}
@@ -0,0 +1,180 @@
+#pragma once
+#include "doc/writer.hpp"
+#include <brick-timer>
+#include <optional>
+#include <utility>
+#include <iostream>
+#include <iomanip>
+
+namespace umd::doc
+{
+
+    /* Profiling of the conversion, enabled by ‹mu --profile›: for each stage
+     * of doc::convert and for each category of writer calls, the time spent
+     * (in cycles, as measured by brq::timer), the number of calls and the
+     * number of bytes of output produced. Stages nest (a table contains text,
+     * which calls the writer), so each row includes the rows that it calls;
+     * recursive stages (nested blocks) are counted once per level. Output
+     * held back in the named buffers of a stream (footnotes in HTML) is not
+     * counted. The counters are global, i.e. they sum over all documents
+     * converted in a run. */
+
+    struct profile
+    {
+        enum stage
+        {
+            directive, table, dispmath, picture, nested, quote, code, heading,
+            list, footnote, emit_text,
+            w_meta, w_text, w_heading, w_span, w_math, w_eqn, w_list, w_mpost,
+            w_table, w_code, w_block, w_footnote, w_paragraph,
+            last
+        };
+
+        static constexpr const char *names[] =
+        {
+            "try_directive", "try_table", "try_dispmath", "try_picture", "try_nested",
+            "try_quote", "emit_code", "heading", "list", "footnote", "emit_text",
+            "w: meta", "w: text", "w: heading", "w: span", "w: math", "w: eqn", "w: list",
+            "w: mpost", "w: table", "w: code", "w: quote/nest", "w: footnote", "w: paragraph"
+        };
+
+        static_assert( std::size( names ) == last );
+
+        template< stage s >
+        using timer = brq::timer< std::integral_constant< stage, s > >;
+
+        static inline std::array< std::atomic< long >, last > bytes;
+
+        static void print( std::ostream &o )
+        {
+            o << std::left << std::setw( 16 ) << "stage" << std::right << std::setw( 16 ) << "cycles"
+              << std::setw( 12 ) << "hits" << std::setw( 14 ) << "bytes" << std::endl;
+
+            auto row = [&]( stage s, std::pair< long, long > t )
+            {
+                if ( t.second )
+                    o << std::left << std::setw( 16 ) << names[ s ] << std::right
+                      << std::setw( 16 ) << t.first << std::setw( 12 ) << t.second
+                      << std::setw( 14 ) << bytes[ s ] << std::endl;
+            };
+
+            [&]< size_t... i >( std::index_sequence< i... > )
+            {
+                ( row( stage( i ), timer< stage( i ) >::read() ), ... );
+            }( std::make_index_sequence< last >() );
+        }
+    };
+
+    /* A writer that passes all calls on to another writer, timing them on the
+     * way. It also provides the output stream to the probes in convert. */
+
+    struct w_profile final : writer
+    {
+        writer &w;
+        stream &out;
+
+        w_profile( writer &w, stream &out ) : w( w ), out( out ) {}
+
+        /* Measures the lifetime of the probe as ‹s›; does nothing (other than
+         * a test of the pointer) if ‹p› is null, i.e. if profiling is off. */
+
+        template< profile::stage s >
+        struct probe
+        {
+            w_profile *p;
+            std::optional< profile::timer< s > > t;
+            size_t start = 0;
+
+            probe( w_profile *p ) : p( p )
+            {
+                if ( p )
+                    start = p->out.tell(), t.emplace();
+            }
+
+            ~probe()
+            {
+                if ( p )
+                    t.reset(), profile::bytes[ s ] += p->out.tell() - start;
+            }
+        };
+
+        template< profile::stage s, typename call_t >
+        void pass( call_t call )
+        {
+            probe< s > _( this );
+            call();
+        }
+
+        using enum profile::stage;
+
+        void meta( sv k, sv v ) override { pass< w_meta >( [&]{ w.meta( k, v ); } ); }
+        void meta_end() override { pass< w_meta >( [&]{ w.meta_end(); } ); }
+        void html( sv s ) override { pass< w_text >( [&]{ w.html( s ); } ); }
+        void text( std::u32string_view s ) override { pass< w_text >( [&]{ w.text( s ); } ); }
+
+        void heading_start( int l, sv num, sv ref ) override
+        {
+            pass< w_heading >( [&]{ w.heading_start( l, num, ref ); } );
+        }
+
+        void heading_stop() override { pass< w_heading >( [&]{ w.heading_stop(); } ); }
+
+        void em_start() override { pass< w_span >( [&]{ w.em_start(); } ); }
+        void em_stop() override { pass< w_span >( [&]{ w.em_stop(); } ); }
+        void tt_start() override { pass< w_span >( [&]{ w.tt_start(); } ); }
+        void tt_stop() override { pass< w_span >( [&]{ w.tt_stop(); } ); }
+        void bf_start() override { pass< w_span >( [&]{ w.bf_start(); } ); }
+        void bf_stop() override { pass< w_span >( [&]{ w.bf_stop(); } ); }
+        void small_start() override { pass< w_span >( [&]{ w.small_start(); } ); }
+        void small_stop() override { pass< w_span >( [&]{ w.small_stop(); } ); }
+        void ref_start( sv r, bool g ) override { pass< w_span >( [&]{ w.ref_start( r, g ); } ); }
+        void ref_stop() override { pass< w_span >( [&]{ w.ref_stop(); } ); }
+        void math_start() override { pass< w_math >( [&]{ w.math_start(); } ); }
+        void math_stop() override { pass< w_math >( [&]{ w.math_stop(); } ); }
+
+        void eqn_start( int c, std::string a ) override { pass< w_eqn >( [&]{ w.eqn_start( c, a ); } ); }
+        void eqn_new_cell() override { pass< w_eqn >( [&]{ w.eqn_new_cell(); } ); }
+        void eqn_new_row() override { pass< w_eqn >( [&]{ w.eqn_new_row(); } ); }
+        void eqn_stop() override { pass< w_eqn >( [&]{ w.eqn_stop(); } ); }
+
+        void enum_start( int l, int f, bool a ) override { pass< w_list >( [&]{ w.enum_start( l, f, a ); } ); }
+        void enum_item() override { pass< w_list >( [&]{ w.enum_item(); } ); }
+        void enum_stop() override { pass< w_list >( [&]{ w.enum_stop(); } ); }
+        void bullet_start( int l ) override { pass< w_list >( [&]{ w.bullet_start( l ); } ); }
+        void bullet_item() override { pass< w_list >( [&]{ w.bullet_item(); } ); }
+        void bullet_stop() override { pass< w_list >( [&]{ w.bullet_stop(); } ); }
+
+        void mpost_start() override { pass< w_mpost >( [&]{ w.mpost_start(); } ); }
+        void mpost_write( std::string_view s ) override { pass< w_mpost >( [&]{ w.mpost_write( s ); } ); }
+        void mpost_stop() override { pass< w_mpost >( [&]{ w.mpost_stop(); } ); }
+
+        bool svg_pictures() override { return w.svg_pictures(); }
+        void svg_start() override { pass< w_mpost >( [&]{ w.svg_start(); } ); }
+        void svg_write( std::string_view s ) override { pass< w_mpost >( [&]{ w.svg_write( s ); } ); }
+        void svg_stop() override { pass< w_mpost >( [&]{ w.svg_stop(); } ); }
+
+        void table_start( columns c, bool r ) override { pass< w_table >( [&]{ w.table_start( c, r ); } ); }
+        void table_new_cell( int s ) override { pass< w_table >( [&]{ w.table_new_cell( s ); } ); }
+        void table_new_row( bool r ) override { pass< w_table >( [&]{ w.table_new_row( r ); } ); }
+        void table_stop() override { pass< w_table >( [&]{ w.table_stop(); } ); }
+
+        void code_start( sv t ) override { pass< w_code >( [&]{ w.code_start( t ); } ); }
+        void code_line( sv l ) override { pass< w_code >( [&]{ w.code_line( l ); } ); }
+        void code_stop() override { pass< w_code >( [&]{ w.code_stop(); } ); }
+        void quote_start() override { pass< w_block >( [&]{ w.quote_start(); } ); }
+        void quote_stop() override { pass< w_block >( [&]{ w.quote_stop(); } ); }
+        void nest_start() override { pass< w_block >( [&]{ w.nest_start(); } ); }
+        void nest_end() override { pass< w_block >( [&]{ w.nest_end(); } ); }
+        void footnote_head() override { pass< w_footnote >( [&]{ w.footnote_head(); } ); }
+        void footnote_start() override { pass< w_footnote >( [&]{ w.footnote_start(); } ); }
+        void footnote_stop() override { pass< w_footnote >( [&]{ w.footnote_stop(); } ); }
+
+        void paragraph() override { pass< w_paragraph >( [&]{ w.paragraph(); } ); }
+        void pagebreak() override { pass< w_paragraph >( [&]{ w.pagebreak(); } ); }
+        void linebreak() override { pass< w_paragraph >( [&]{ w.linebreak(); } ); }
+        void tab() override { pass< w_paragraph >( [&]{ w.tab(); } ); }
+        void hrule( char32_t c ) override { pass< w_paragraph >( [&]{ w.hrule( c ); } ); }
+        void end() override { pass< w_paragraph >( [&]{ w.end(); } ); }
+    };
+
+}
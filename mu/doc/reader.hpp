@@ -0,0 +1,221 @@
+#pragma once
+#include "doc/convert.hpp"
+#include "doc/util.hpp"
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <system_error>
+#include <utility>
+#include <unistd.h>
+
+namespace umd::doc
+{
+
+    /* Read a document incrementally, so that input that arrives through a
+     * pipe can be converted without first reading all of it into memory (see
+     * convert_stream below). The decoded text is kept in a window, the front
+     * of which is dropped once it has been converted. The reader also keeps
+     * track of ‹cuts›: the starts of non-empty lines that follow an empty
+     * line, outside of raw metapost blocks. Every block ends at an empty
+     * line, hence the text before a cut can be converted without looking at
+     * the text that follows, footnote bodies aside. */
+
+    struct reader
+    {
+        using sv = std::u32string_view;
+        static constexpr size_t block = 64 * 1024;
+
+        int _fd;
+        bool eof = false, _raw = false;
+        std::string _partial; /* an incomplete UTF-8 sequence at the end of the last read */
+        std::u32string text;
+        std::vector< size_t > cuts;
+        size_t _scanned = 0;
+
+        reader( int fd ) : _fd( fd ) {}
+
+        /* the text up to this point consists of whole paragraphs */
+        size_t complete() const { return eof ? text.size() : cuts.empty() ? 0 : cuts.back(); }
+
+        void read()
+        {
+            std::string buf = std::move( _partial );
+            size_t have = buf.size();
+            ssize_t got;
+
+            buf.resize( have + block );
+
+            while ( ( got = ::read( _fd, buf.data() + have, block ) ) < 0 )
+                if ( errno != EINTR )
+                    throw std::system_error( errno, std::generic_category(), "reading input" );
+
+            buf.resize( have + got );
+            eof = got == 0;
+            size_t keep = 0;
+
+            /* hold back a multi-byte sequence that is cut short by the block
+             * boundary; at the end of input, from_utf8 rejects it instead */
+            for ( size_t i = 1; !eof && i <= std::min( buf.size(), size_t( 3 ) ); ++i )
+                if ( uint8_t c = buf[ buf.size() - i ]; ( c & 0xc0 ) != 0x80 )
+                {
+                    size_t len = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+                    keep = len > i ? i : 0;
+                    break;
+                }
+
+            _partial = buf.substr( buf.size() - keep );
+            buf.resize( buf.size() - keep );
+            text += from_utf8( buf );
+            scan();
+        }
+
+        /* find the cuts among the lines that were completed by the last read */
+        void scan()
+        {
+            size_t end = eof ? text.size() : text.rfind( U'\n' ) + 1;
+
+            for ( size_t pos = _scanned; pos < end; )
+            {
+                size_t eol = std::min( text.find( U'\n', pos ), text.size() );
+                sv line( text.data() + pos, eol - pos );
+
+                if ( _raw )
+                    _raw = line != U"$$end_mpost";
+                else if ( starts_with( line, sv( U"$$raw_mpost" ) ) )
+                    _raw = true;
+                else if ( pos >= 2 && text[ pos - 2 ] == U'\n' && !line.empty() )
+                    cuts.push_back( pos );
+
+                pos = eol + 1;
+            }
+
+            _scanned = std::max( _scanned, end );
+        }
+
+        /* read until the header (the lines at the start that begin with a
+         * colon) is complete, and return it */
+        sv header()
+        {
+            for ( size_t pos = 0; ; )
+                if ( pos < text.size() && text[ pos ] != U':' )
+                    return sv( text.data(), pos );
+                else if ( size_t eol = text.find( U'\n', pos ); eol != sv::npos )
+                    pos = eol + 1;
+                else if ( eof )
+                    return text;
+                else
+                    read();
+        }
+
+        void drop( size_t n )
+        {
+            text.erase( 0, n );
+            _scanned -= n;
+            cuts.erase( cuts.begin(), std::upper_bound( cuts.begin(), cuts.end(), n ) );
+
+            for ( auto &c : cuts )
+                c -= n;
+        }
+    };
+
+    /* Convert a document from a reader, one chunk of whole paragraphs at a
+     * time, and flush the output of each chunk before reading on. The header
+     * is converted (and its output flushed) as soon as it has been read.
+     *
+     * The body of a footnote follows its reference, possibly in a later
+     * chunk. Therefore, each chunk is converted with lookahead: the window
+     * extends past the end of the chunk at least to a paragraph that starts
+     * with a footnote mark (i.e. the body that a reference in the chunk would
+     * find), or by ‹max_lookahead› characters if there is no such paragraph.
+     * If the body of a footnote is still not in the window, the output may
+     * differ from that of a conversion of the entire document, and a warning
+     * is printed. */
+
+    template< typename writer_t, typename... args_t >
+    void convert_stream( reader &in, stream &out, pic::cache *pics, args_t... args )
+    {
+        using sv = std::u32string_view;
+        constexpr size_t chunk = 64 * 1024, max_lookahead = 1024 * 1024;
+
+        writer_t w( out, args... );
+        convert conv( in.header(), w, std::make_shared< convert_base::footnotes >() );
+        conv._pic_cache = pics;
+        conv.header();
+        out.sync();
+
+        /* positions in the window are kept as offsets, since reading on may
+         * move the text around */
+        size_t done = conv.todo.top().data() - in.text.data(), last = sv::npos;
+        std::vector< size_t > used; /* bodies in the lookahead that were already emitted */
+        bool warned = false;
+
+        auto lookahead = [&]( size_t stop )
+        {
+            for ( auto c = std::lower_bound( in.cuts.begin(), in.cuts.end(), stop );
+                  c != in.cuts.end() && c + 1 != in.cuts.end(); ++c )
+                if ( convert_base::is_footnote_mark( in.text[ *c ] ) )
+                    return true;
+
+            return in.cuts.back() - stop >= max_lookahead;
+        };
+
+        while ( true )
+        {
+            size_t stop;
+
+            while ( true )
+            {
+                auto c = std::lower_bound( in.cuts.begin(), in.cuts.end(), done + chunk );
+                stop = in.eof ? in.text.size() : c == in.cuts.end() ? sv::npos : *c;
+
+                if ( in.eof || ( stop != sv::npos && lookahead( stop ) ) )
+                    break;
+
+                in.read();
+            }
+
+            const char32_t *text = in.text.data();
+            sv window( text, in.complete() );
+
+            conv._footnotes = convert_base::index_footnotes( window );
+            auto &index = *conv._footnotes;
+
+            for ( size_t u : used )
+                if ( auto fn = conv.find_footnote( text + u ); fn != index.data() + index.size() &&
+                                                               fn->par.data() == text + u )
+                    fn->used = true;
+
+            conv.todo.bottom() = window.substr( done );
+            conv._last_footnote = last == sv::npos ? sv() : window.substr( last, conv._last_footnote.size() );
+            conv._open_footnote = conv._foreign_footnote = false;
+
+            if ( in.eof )
+                break;
+
+            while ( conv.todo.top().data() < text + stop && conv.block() );
+
+            if ( ( conv._open_footnote || conv._foreign_footnote ) && !std::exchange( warned, true ) )
+                std::cerr << "warning: a footnote body may be beyond the lookahead window, "
+                          << "the output may differ from a non-streaming conversion" << std::endl;
+
+            /* drop the text that was converted */
+            done = conv.todo.top().data() - text;
+            auto lf = conv._last_footnote.data();
+            last = lf && lf >= text + done ? lf - text - done : sv::npos;
+            used.clear();
+
+            for ( auto &fn : *conv._footnotes )
+                if ( fn.used && fn.par.data() >= text + done )
+                    used.push_back( fn.par.data() - text - done );
+
+            in.drop( done );
+            done = 0;
+            out.sync();
+        }
+
+        conv.body();
+        conv.end_list( -1 );
+        w.end();
+    }
+
+}
@@ -0,0 +1,226 @@
+#pragma once
+#include "doc/convert.hpp"
+#include "doc/w_html.hpp"
+#include "doc/cache.hpp"
+#include <vector>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <exception>
+
+namespace umd::doc
+{
+
+    /* Split the body of a document (everything after the header) into parts
+     * that start with a level-1 heading. Only headings at the start of a line
+     * that follows an empty line are considered (the empty line always ends
+     * the previous block, so the heading starts a new one). Raw metapost
+     * blocks are skipped, since their content is not interpreted. The first
+     * part is whatever precedes the first such heading (possibly nothing). */
+
+    static inline std::vector< std::u32string_view > split_sections( std::u32string_view body )
+    {
+        std::vector< std::u32string_view > parts;
+        size_t start = 0;
+        bool raw = false;
+
+        for ( size_t pos = 0; pos < body.size(); )
+        {
+            size_t eol = std::min( body.find( U'\n', pos ), body.size() );
+            auto line = body.substr( pos, eol - pos );
+
+            if ( raw )
+                raw = line != U"$$end_mpost";
+            else if ( starts_with( line, std::u32string_view( U"$$raw_mpost" ) ) )
+                raw = true;
+            else if ( pos >= 2 && body[ pos - 2 ] == U'\n' &&
+                      starts_with( line, std::u32string_view( U"# " ) ) )
+            {
+                parts.push_back( body.substr( start, pos - start ) );
+                start = pos;
+            }
+
+            pos = eol + 1;
+        }
+
+        parts.push_back( body.substr( start ) );
+        return parts;
+    }
+
+    /* Convert a document to HTML in parts made of whole level-1 sections,
+     * using up to ‹jobs› threads. Each part is written into its own in-memory
+     * stream; the results are then joined in order, renumbering footnotes
+     * and sections on the way (see w_html::emit_counter), so that the output
+     * is the same as that of a sequential conversion. If the parts turn out
+     * to depend on each other after all (a footnote with its body in a
+     * different part, or a span or formula left open at the end of a part),
+     * the document is converted again, sequentially.
+     *
+     * With a ‹cache›, each level-1 section is a part of its own, and the
+     * output of parts that were converted before (in the same context, i.e.
+     * with the same header) is taken from the cache. */
+
+    static inline void convert_html_sections( stream &out, std::u32string_view doc,
+                                              std::string embed, bool highlight, int jobs,
+                                              part_cache *cache = nullptr,
+                                              pic::cache *pics = nullptr )
+    {
+        using sv = std::u32string_view;
+
+        struct part
+        {
+            sv text;
+            stream out;
+            std::unique_ptr< w_html > w;
+            std::unique_ptr< convert< w_html > > conv;
+            std::exception_ptr error;
+            bool clean = false, cacheable = false;
+            part_cache::key key;
+            const part_output *cached = nullptr;
+
+            std::array< int, 7 > counters() const
+            {
+                return { w->_last_footnote_num, w->_sections[ 1 ], w->_sections[ 2 ], w->_sections[ 3 ],
+                         w->_sections[ 4 ], w->_sections[ 5 ], w->_sections[ 6 ] };
+            }
+        };
+
+        auto index = convert_base::index_footnotes( doc );
+        std::deque< part > parts; /* the writers refer to part::out */
+
+        /* the header goes with the first part and provides the metadata for
+         * the rest */
+        auto &first = parts.emplace_back();
+        first.w = std::make_unique< w_html >( first.out, embed, highlight );
+        first.conv = std::make_unique< convert< w_html > >( doc, *first.w, index );
+        first.conv->_pic_cache = pics;
+        first.conv->header();
+
+        /* without a cache, adjacent sections are merged into parts of similar
+         * size, a few per thread, to keep the per-part overhead down */
+        auto body = first.conv->todo.top();
+        auto header = doc.substr( 0, body.data() - doc.data() );
+        size_t target = cache ? 0 : body.size() / ( 4 * jobs ) + 1;
+        std::vector< sv > text;
+
+        for ( auto s : split_sections( body ) )
+            if ( !text.empty() && text.back().size() < target )
+                text.back() = sv( text.back().data(), text.back().size() + s.size() );
+            else
+                text.push_back( s );
+
+        for ( size_t i = 0; i < text.size(); ++i )
+        {
+            auto &p = i ? parts.emplace_back() : first;
+            p.text = text[ i ];
+
+            /* the first part includes the header, i.e. the embedded files */
+            if ( cache && ( i > 0 || embed.empty() ) )
+            {
+                std::string flags{ char( '0' + ( i > 0 ) ), char( '0' + ( i + 1 == text.size() ) ),
+                                   char( '0' + highlight ) };
+                p.key = part_cache::make_key( std::string_view( "html" ), embed, flags, header, p.text );
+                p.cacheable = true;
+
+                if ( ( p.cached = cache->find( p.key ) ) )
+                    continue;
+            }
+
+            if ( i > 0 )
+            {
+                p.w = std::make_unique< w_html >( p.out, embed, highlight );
+                p.w->_meta = parts[ 0 ].w->_meta;
+                p.w->_continued = true;
+                p.conv = std::make_unique< convert< w_html > >( p.text, *p.w, index );
+                p.conv->default_typing = parts[ 0 ].conv->default_typing;
+                p.conv->_pic_cache = pics;
+            }
+            else
+                p.conv->todo.top() = p.text;
+
+            p.w->_section_mode = true;
+        }
+
+        auto run = [&]( part &p )
+        {
+            if ( p.cached )
+                return void( p.clean = true );
+
+            try
+            {
+                p.conv->body();
+                p.conv->end_list( -1 );
+
+                if ( &p == &parts.back() )
+                    p.w->end();
+                else
+                    p.w->section_end();
+
+                p.clean = !p.conv->_foreign_footnote && p.conv->_spans.empty() && !p.conv->in_math;
+            }
+            catch ( ... )
+            {
+                p.error = std::current_exception();
+            }
+        };
+
+        std::atomic< size_t > next = 0;
+        std::vector< std::thread > pool;
+
+        for ( int i = 0; i < std::min( jobs, int( parts.size() ) ); ++i )
+            pool.emplace_back( [&]
+            {
+                for ( size_t k; ( k = next++ ) < parts.size(); )
+                    run( parts[ k ] );
+            } );
+
+        for ( auto &t : pool )
+            t.join();
+
+        bool clean = true;
+
+        for ( auto &p : parts )
+            if ( p.error )
+                std::rethrow_exception( p.error );
+            else
+                clean = clean && p.clean;
+
+        /* the output of a part can be reused as long as it did not depend on
+         * the text that follows it (which is not part of the key) */
+        if ( cache )
+            for ( auto &p : parts )
+                if ( p.cacheable && !p.cached && p.clean && !p.conv->_open_footnote )
+                    cache->insert( p.key, { std::string( p.out.data() ), p.w->_counter_refs, p.counters() } );
+
+        if ( !clean )
+        {
+            w_html w( out, embed, highlight );
+            convert conv( doc, w );
+            conv._pic_cache = pics;
+            return conv.run();
+        }
+
+        std::array< int, 7 > offset = { 0 };
+
+        for ( auto &p : parts )
+        {
+            auto data = p.cached ? std::string_view( p.cached->data ) : p.out.data();
+            auto &refs = p.cached ? p.cached->refs : p.w->_counter_refs;
+            auto counters = p.cached ? p.cached->counters : p.counters();
+            size_t done = 0;
+
+            for ( auto [ pos, counter, value ] : refs )
+            {
+                out.put( data.substr( done, pos - done ) );
+                out.put( value + offset[ counter ] );
+                done = pos + std::to_string( value ).size();
+            }
+
+            out.put( data.substr( done ) );
+
+            for ( int i = 0; i < 7; ++i )
+                offset[ i ] += counters[ i ];
+        }
+    }
+
+}
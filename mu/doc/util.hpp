@@ -1,19 +1,129 @@
 #pragma once
 #include <string_view>
-#include <locale>
-#include <codecvt>
+#include <stdexcept>
 #include <fstream>
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Encode UTF-32 as UTF-8. The output buffer must have room for 4 bytes per
+ * input character; returns a pointer past the last byte written. Runs of
+ * ASCII, which make up most of the output of any writer, are narrowed 8
+ * characters at a time. */
+
+static inline char *to_utf8( char *out, std::u32string_view w )
+{
+    const char32_t *i = w.data(), *end = i + w.size();
+
+    while ( i != end )
+    {
+#ifdef __SSE2__
+        if ( end - i >= 8 )
+        {
+            auto a = _mm_loadu_si128( reinterpret_cast< const __m128i * >( i ) ),
+                 b = _mm_loadu_si128( reinterpret_cast< const __m128i * >( i + 4 ) );
+            auto high = _mm_cmpgt_epi32( _mm_or_si128( a, b ), _mm_set1_epi32( 0x7f ) );
+
+            if ( !_mm_movemask_epi8( high ) )
+            {
+                auto words = _mm_packs_epi32( a, b );
+                _mm_storel_epi64( reinterpret_cast< __m128i * >( out ), _mm_packus_epi16( words, words ) );
+                out += 8, i += 8;
+                continue;
+            }
+        }
+#endif
+        uint32_t c = *i++;
+
+        if ( c < 0x80 )
+            *out++ = c;
+        else if ( c < 0x800 )
+        {
+            *out++ = 0xc0 | ( c >> 6 );
+            *out++ = 0x80 | ( c & 0x3f );
+        }
+        else if ( c < 0x10000 )
+        {
+            *out++ = 0xe0 | ( c >> 12 );
+            *out++ = 0x80 | ( ( c >> 6 ) & 0x3f );
+            *out++ = 0x80 | ( c & 0x3f );
+        }
+        else
+        {
+            *out++ = 0xf0 | ( c >> 18 );
+            *out++ = 0x80 | ( ( c >> 12 ) & 0x3f );
+            *out++ = 0x80 | ( ( c >> 6 ) & 0x3f );
+            *out++ = 0x80 | ( c & 0x3f );
+        }
+    }
+
+    return out;
+}
+
 static inline std::string to_utf8( std::u32string_view w )
 {
-    std::wstring_convert< std::codecvt_utf8< char32_t >, char32_t > conv;
-    return conv.to_bytes( w.begin(), w.end() );
+    std::string out( 4 * w.size(), 0 );
+    out.resize( to_utf8( out.data(), w ) - out.data() );
+    return out;
 }
 
+/* Decode UTF-8 into UTF-32. The output is sized exactly (one counting pass
+ * over the input, then one decoding pass), so that there are no intermediate
+ * copies or reallocations, which matters for large inputs. Like the
+ * std::wstring_convert this replaces, throws std::range_error on malformed
+ * input: truncated sequences, stray continuation bytes, overlong forms,
+ * surrogates and anything above U+10FFFF. */
+
 static inline std::u32string from_utf8( std::string_view v )
 {
-    std::wstring_convert< std::codecvt_utf8< char32_t >, char32_t > conv;
-    return conv.from_bytes( v.begin(), v.end() );
+    auto in = reinterpret_cast< const unsigned char * >( v.data() );
+    size_t size = v.size(), count = 0;
+
+    for ( size_t i = 0; i < size; ++i )
+        count += ( in[ i ] & 0xc0 ) != 0x80;
+
+    std::u32string out( count, 0 );
+    char32_t *o = out.data(), *o_end = o + count;
+
+    auto bad = [] { throw std::range_error( "malformed UTF-8 input" ); };
+
+    for ( size_t i = 0; i < size; )
+    {
+        if ( in[ i ] < 0x80 ) /* fast path for runs of ASCII */
+        {
+            *o++ = in[ i++ ];
+            continue;
+        }
+
+        /* the smallest value that needs a sequence of each length */
+        static constexpr char32_t min[] = { 0, 0, 0x80, 0x800, 0x10000 };
+
+        int len = in[ i ] >= 0xf5 ? 0 : in[ i ] >= 0xf0 ? 4 : in[ i ] >= 0xe0 ? 3 : in[ i ] >= 0xc0 ? 2 : 0;
+        char32_t c = in[ i ] & ( 0x7f >> len );
+
+        if ( !len || i + len > size || o == o_end )
+            bad();
+
+        for ( int j = 1; j < len; ++j )
+            if ( ( in[ i + j ] & 0xc0 ) != 0x80 )
+                bad();
+            else
+                c = ( c << 6 ) | ( in[ i + j ] & 0x3f );
+
+        if ( c < min[ len ] || c > 0x10ffff || ( c >= 0xd800 && c < 0xe000 ) )
+            bad();
+
+        *o++ = c;
+        i += len;
+    }
+
+    return out;
 }
 
 static inline std::u32string read_file( std::istream &in )
@@ -34,8 +144,41 @@ static inline std::u32string read_file( std::istream &in )
     return from_utf8( buffer );
 }
 
+/* Regular files are mapped and decoded straight from the page cache, instead
+ * of being copied into a std::string first. Anything that can't be mapped
+ * (pipes, empty files) goes through the stream-based variant above. */
+
 static inline std::u32string read_file( std::string path )
 {
+    int fd = open( path.c_str(), O_RDONLY );
+    struct stat st;
+
+    if ( fd >= 0 && fstat( fd, &st ) == 0 && S_ISREG( st.st_mode ) && st.st_size > 0 )
+    {
+        void *map = mmap( nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        close( fd );
+
+        if ( map != MAP_FAILED )
+        {
+            std::string_view data( static_cast< const char * >( map ), st.st_size );
+            madvise( map, st.st_size, MADV_SEQUENTIAL );
+
+            try
+            {
+                auto rv = from_utf8( data );
+                munmap( map, st.st_size );
+                return rv;
+            }
+            catch ( ... )
+            {
+                munmap( map, st.st_size );
+                throw;
+            }
+        }
+    }
+    else if ( fd >= 0 )
+        close( fd );
+
     std::ifstream ifs( path );
     return read_file( ifs );
 }
@@ -1,31 +1,40 @@
 #pragma once
 #include "writer.hpp"
 #include "w_tex.hpp"
+#include "highlight.hpp"
 #include "util.hpp"
 #include <vector>
 #include <sstream>
 #include <iostream>
 #include <map>
+#include <optional>
 #include <utility>
 #include <brick-string>
 
 namespace umd::doc
 {
 
-    struct w_html : w_tex /* w_tex for math */
+    struct w_html final : w_tex /* w_tex for math */
     {
+        /* bump whenever the output changes, which invalidates the part cache
+         * (see doc/cache.hpp); 2 = pictures drawn as inline svg */
+        static constexpr uint32_t output_version = 2;
+
         std::string _embed;
+        bool _highlight; /* highlight code here instead of using highlight.js */
+        std::optional< highlight::lexer > _lexer;
 
-        w_html( stream &out, std::string embed = "" ) : w_tex( out ), _embed( embed )
+        w_html( stream &out, std::string embed = "", bool highlight = false )
+            : w_tex( out ), _embed( embed ), _highlight( highlight )
         {
             _sections.resize( 7, 0 );
             _section_num.resize( 7 );
         }
 
-        std::map< sv, sv > _meta;
+        std::map< std::u32string, std::u32string > _meta;
 
         std::vector< int > _sections;
-        std::vector< sv > _section_num;
+        std::vector< std::u32string > _section_num;
 
         bool _in_foothead = false, _in_footnote = false;
         std::u32string _foothead, _footnote;
@@ -38,10 +47,43 @@ namespace umd::doc
         int _table_rows, _table_cells;
         std::vector< std::string > _table_class;
 
-        bool _in_mpost = false;
+        bool _in_mpost = false, _in_svg = false;
         int _heading = 0; // currently open <hN> tag (must not be nested)
         std::u32string _ref_prefix;
 
+        /* When a document is converted in independent sections (see
+         * doc/sections.hpp), each section gets its own writer. The counters
+         * that carry over from one section to the next (footnote numbers and
+         * those section numbers that are not reset by a level-1 heading) then
+         * start from zero, and each place where one of them is printed is
+         * recorded, so that they can be renumbered when the sections are
+         * joined. Counter 0 is the footnote number, the rest index _sections. */
+
+        struct counter_ref
+        {
+            size_t offset;
+            int counter, value;
+        };
+
+        bool _section_mode = false, _continued = false;
+        std::vector< counter_ref > _counter_refs;
+
+        void emit_counter( int counter, int value )
+        {
+            if ( _section_mode && ( counter == 0 || counter == 1 || counter == 6 ) )
+                _counter_refs.push_back( { out.tell(), counter, value } );
+            out.emit( value );
+        }
+
+        /* close a section that is not the last one; same as what the heading
+         * of the next section would do (the writer of that section is then
+         * constructed with _continued set) */
+        void section_end()
+        {
+            place_footnotes();
+            paragraph();
+        }
+
         sv fgcolor() const
         {
             if ( auto i = _meta.find( U"fgcolor" ); i != _meta.end() )
@@ -50,7 +92,7 @@ namespace umd::doc
                 return U"black";
         }
 
-        void meta( sv key, sv value ) override { _meta[ key ] = value; }
+        void meta( sv key, sv value ) override { _meta[ std::u32string( key ) ] = value; }
         void meta_end() override
         {
             if ( _meta[ U"naked" ] == U"yes" )
@@ -67,7 +109,8 @@ namespace umd::doc
                 out.emit( "<link rel=\"stylesheet\" href=\"common.css\">" );
                 out.emit( "<link rel=\"stylesheet\" href=\"", css ,"\">" );
                 out.emit( "<link rel=\"stylesheet\" href=\"fonts.css\">" );
-                out.emit( "<script src=\"highlight.js\"></script>" );
+                if ( !_highlight )
+                    out.emit( "<script src=\"highlight.js\"></script>" );
                 out.emit( "<script src=\"toc.js\"></script>" );
             }
             else
@@ -75,10 +118,12 @@ namespace umd::doc
                 out.emit( "<style>",  read_file( _embed + "/common.css" ), "</style>" );
                 out.emit( "<style>",  read_file( _embed + "/" + css ), "</style>" );
                 out.emit( "<style>",  read_file( _embed + "/fonts.css" ), "</style>" );
-                out.emit( "<script>", read_file( _embed + "/highlight.js" ), "</script>" );
+                if ( !_highlight )
+                    out.emit( "<script>", read_file( _embed + "/highlight.js" ), "</script>" );
                 out.emit( "<script>", read_file( _embed + "/toc.js" ), "</script>" );
             }
-            out.emit( "<script>hljs.initHighlightingOnLoad();</script>" );
+            if ( !_highlight )
+                out.emit( "<script>hljs.initHighlightingOnLoad();</script>" );
             out.emit( "</head><body onload=\"makeTOC()\"><ol id=\"toc\"></ol><div>" );
         }
 
@@ -128,10 +173,12 @@ namespace umd::doc
                 w_tex::text( t );
             else
             {
-                if ( allow_div )
+                if ( allow_div && !_in_svg )
                     ensure_div();
 
-                process( t, char_cb, [&]( auto s ) { html( s ); } );
+                static const charset special( U"\u0307&<>" );
+                auto next = [&]( sv s, size_t i ) { return special.next( s, i ); };
+                process( t, next, char_cb, [&]( auto s ) { html( s ); } );
             }
         }
 
@@ -142,7 +189,11 @@ namespace umd::doc
             if ( level == 1 )
                 _ref_prefix = ref;
 
-            paragraph();
+            if ( _continued )
+                _continued = false;
+            else
+                paragraph();
+
             _heading = level;
 
             out.emit( "<a name=\"", _ref_prefix );
@@ -153,14 +204,14 @@ namespace umd::doc
 
             for ( int i = 1; i < level; ++i )
                 if ( _section_num[ i ].empty() )
-                    out.emit( _sections[ i ], "." );
+                    emit_counter( i, _sections[ i ] ), out.emit( "." );
                 else
                     out.emit( _section_num[ i ], "." );
 
             if ( num.empty() )
             {
                 if ( _meta[ U"toc" ] == U"yes" )
-                    out.emit( ++ _sections[ level ] );
+                    emit_counter( level, ++ _sections[ level ] );
                 _section_num[ level ] = U"";
             }
             else
@@ -178,11 +229,29 @@ namespace umd::doc
             _heading = 0;
         }
 
-        /* spans ; may be also called within mpost btex/etex */
-        void em_start()   override { html( _in_mpost ? U"{\\em{}" : U"<em>" ); }
-        void em_stop()    override { html( _in_mpost ? U"}" : U"</em>" ); }
-        void tt_start()   override { html( _in_mpost ? U"{\\tt{}" : U"<code>" ); }
-        void tt_stop()    override { html( _in_mpost ? U"}" : U"</code>" ); }
+        /* spans ; may be also called within mpost btex/etex or svg labels */
+        void span_markup( sv mpost, sv svg, sv html_ ) { html( _in_mpost ? mpost : _in_svg ? svg : html_ ); }
+
+        void em_start()   override { span_markup( U"{\\em{}", U"<tspan class=\"em\">", U"<em>" ); }
+        void em_stop()    override { span_markup( U"}", U"</tspan>", U"</em>" ); }
+        void tt_start()   override { span_markup( U"{\\tt{}", U"<tspan class=\"tt\">", U"<code>" ); }
+        void tt_stop()    override { span_markup( U"}", U"</tspan>", U"</code>" ); }
+
+        void bf_start() override
+        {
+            if ( _in_svg )
+                html( U"<tspan class=\"bf\">" );
+            else
+                w_tex::bf_start();
+        }
+
+        void bf_stop() override
+        {
+            if ( _in_svg )
+                html( U"</tspan>" );
+            else
+                w_tex::bf_stop();
+        }
 
         /* generate svgtex-compatible markup */
         void eqn_start( int n, std::string ) override
@@ -239,6 +308,12 @@ namespace umd::doc
         void mpost_stop()  override { html( U"\\stopMPpage</tex></div>" ); _in_mpost = false; }
         void mpost_write( std::string_view s ) override { html( from_utf8( s ) ); }
 
+        /* pictures are drawn inline, with no need for svgtex */
+        bool svg_pictures() override { return true; }
+        void svg_start() override { html( U"<div class=\"center\">" ); _in_svg = true; }
+        void svg_stop()  override { html( U"</div>" ); _in_svg = false; }
+        void svg_write( std::string_view s ) override { html( from_utf8( s ) ); }
+
         void table_start( columns ci, bool even = false ) override
         {
             _table_rule = false;
@@ -325,9 +400,44 @@ namespace umd::doc
         void bullet_item()       override { list_item(); }
         void bullet_stop()       override { list_stop(); html( U"</ul>" ); }
 
-        void code_start( sv t ) override { out.emit( "<pre><code class=\"", t, "\">" ); }
-        void code_line( sv l )  override { text( l, false ); out.emit( "\n" ); }
-        void code_stop()        override { out.emit( "</code></pre>\n" ); }
+        void code_start( sv t ) override
+        {
+            if ( !_highlight )
+                return out.emit( "<pre><code class=\"", t, "\">" );
+
+            /* the hljs class is what highlight.js would have added */
+            if ( auto lang = highlight::find( t ) )
+                _lexer.emplace( *lang );
+            out.emit( "<pre><code class=\"", t, " hljs\">" );
+        }
+
+        void code_line( sv l ) override
+        {
+            if ( !_lexer )
+                return text( l, false ), out.emit( "\n" );
+
+            sv open;
+
+            _lexer->line( l, [&]( highlight::token t, sv s )
+            {
+                if ( auto tag = highlight::html_tag( t ); tag != open )
+                {
+                    if ( !open.empty() )
+                        html( U"</span>" );
+                    if ( !tag.empty() )
+                        html( tag );
+                    open = tag;
+                }
+
+                text( s, false );
+            } );
+
+            if ( !open.empty() )
+                html( U"</span>" );
+            out.emit( "\n" );
+        }
+
+        void code_stop() override { _lexer.reset(); out.emit( "</code></pre>\n" ); }
         void quote_start()      override { out.emit( "<blockquote>\n" ); }
         void quote_stop()       override { out.emit( "</blockquote>\n" ); }
 
@@ -402,12 +512,12 @@ namespace umd::doc
         {
             out.emit( "<a class=\"anchor\" id=\"" );
             out.emit( id );
-            out.emit( num );
+            emit_counter( 0, num );
             out.emit( "\" href=\"#" );
             out.emit( href );
-            out.emit( num );
+            emit_counter( 0, num );
             out.emit( "\"><sup>" );
-            out.emit( num );
+            emit_counter( 0, num );
             out.emit( "</sup></a>" );
         }
 
@@ -7,7 +7,7 @@
 
 namespace umd::doc
 {
-    struct w_lnotes : w_context
+    struct w_lnotes final : w_context
     {
         w_lnotes( stream &out ) : w_context( out ) { doctype = U"lnotes"; }
         int nest_level = 0;
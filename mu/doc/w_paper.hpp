@@ -10,7 +10,7 @@
 namespace umd::doc
 {
 
-    struct w_paper : w_tex
+    struct w_paper final : w_tex
     {
         w_paper( stream &out ) : w_tex( out ) {}
 
@@ -66,7 +66,12 @@ namespace umd::doc
             in_math = false;
         }
 
-        /* lists */
+        /* lists; the overloads below do not override those of writer, so
+         * the converter must still find the inherited ones */
+        using w_tex::enum_start;
+        using w_tex::enum_stop;
+        using w_tex::bullet_stop;
+
         virtual void enum_start( int level, int )
         {
             out.emit( "\\startitemize[packed,",
@@ -7,7 +7,7 @@
 
 namespace umd::doc
 {
-    struct w_slides : w_context
+    struct w_slides final : w_context
     {
         int last_head = 0;
         bool in_slide = false;
@@ -15,7 +15,7 @@ namespace umd::doc
         w_tex( stream &out ) : out( out ) {}
 
         bool _in_math = false;
-        sv format, doctype;
+        std::u32string format, doctype;
 
         std::string heading_cmd( int l )
         {
@@ -109,7 +109,11 @@ namespace umd::doc
                 }
             };
 
-            process( t, char_cb, [&]( auto s )
+            /* within a subscript or a superscript, every character counts */
+            static const charset special = charset( sub ) + sup + U"\u0307&%$#|_[]{}~^\\";
+            auto next = [&]( sv s, size_t i ) { return in_sub || in_sup ? i : special.next( s, i ); };
+
+            process( t, next, char_cb, [&]( auto s )
             {
                 if ( in_sub || in_sup )
                 {
@@ -1,16 +1,35 @@
 #pragma once
+#include "util.hpp"
 #include <brick-min>
 #include <map>
+#include <array>
+#include <cctype>
+#include <algorithm>
 #include <vector>
-#include <codecvt> // codecvt_utf8
-#include <locale>  // wstring_convert
+#include <memory>
+#include <sstream>
+#include <charconv>
+#include <system_error>
+#include <unistd.h>
 
 namespace umd::doc
 {
 
+    /* All writer output goes through a stream. Text is collected in a
+     * buffer (UTF-32 strings are encoded straight into it) which is passed
+     * to write(2) in large chunks. The named buffers are for writers that
+     * need to hold back some output and place it later (see buffer() and
+     * flush()). A stream constructed without a file descriptor keeps all of
+     * its output in memory (see data()). */
+
     struct stream
     {
-        std::ostream &ostr;
+        static constexpr size_t chunk = 64 * 1024;
+
+        int _fd;
+        std::unique_ptr< char[] > _out;
+        size_t _used = 0, _size = 0, _synced = 0;
+
         std::map< std::string, brq::string_builder > _buffers;
         std::string _buffer;
 
@@ -23,7 +42,79 @@ namespace umd::doc
             _buffers.erase( n );
         }
 
-        stream( std::ostream &o ) : ostr( o ) {}
+        stream( int fd = -1 ) : _fd( fd ) {}
+        ~stream() { try { sync(); } catch ( ... ) {} }
+
+        /* pass all buffered output to the file descriptor */
+        void sync()
+        {
+            if ( _fd < 0 )
+                return;
+
+            for ( size_t done = 0; done < _used; )
+                if ( auto r = ::write( _fd, _out.get() + done, _used - done ); r >= 0 )
+                    done += r;
+                else if ( errno != EINTR )
+                    throw std::system_error( errno, std::generic_category(), "writing output" );
+
+            _synced += _used;
+            _used = 0;
+        }
+
+        char *reserve( size_t n )
+        {
+            if ( _used + n > _size )
+                sync();
+
+            if ( _used + n > _size )
+            {
+                size_t size = std::max( { _used + n, 2 * _size, _fd < 0 ? 256 : chunk } );
+                std::unique_ptr< char[] > grown( new char[ size ] );
+                std::copy( _out.get(), _out.get() + _used, grown.get() );
+                _out = std::move( grown );
+                _size = size;
+            }
+
+            return _out.get() + _used;
+        }
+
+        /* the number of bytes written so far (not counting named buffers) */
+        size_t tell() const { return _synced + _used; }
+
+        /* the output of an in-memory stream */
+        std::string_view data() const { return { _out.get(), _used }; }
+
+        void put( std::string_view s )
+        {
+            std::copy( s.begin(), s.end(), reserve( s.size() ) );
+            _used += s.size();
+        }
+
+        void put( std::u32string_view u )
+        {
+            char *start = reserve( 4 * u.size() );
+            _used += to_utf8( start, u ) - start;
+        }
+
+        template< typename T >
+        void put( const T &t )
+        {
+            if constexpr ( std::is_convertible_v< T, std::string_view > )
+                put( std::string_view( t ) );
+            else if constexpr ( std::is_same_v< T, char > )
+                put( std::string_view( &t, 1 ) );
+            else if constexpr ( std::is_integral_v< T > )
+            {
+                char *start = reserve( 24 );
+                _used += std::to_chars( start, start + 24, t ).ptr - start;
+            }
+            else /* same formatting as std::ostream */
+            {
+                std::ostringstream str;
+                str << t;
+                put( std::string_view( str.str() ) );
+            }
+        }
 
         void emit() {}
 
@@ -33,8 +124,10 @@ namespace umd::doc
         template< typename... Ts >
         void emit( const std::u32string_view &u, const Ts & ... ts )
         {
-            std::wstring_convert< std::codecvt_utf8< char32_t >, char32_t > conv;
-            emit( conv.to_bytes( u.begin(), u.end() ), ts... );
+            if ( _buffer.empty() )
+                put( u ), emit( ts... );
+            else
+                emit( to_utf8( u ), ts... );
         }
 
         template< typename... Ts >
@@ -45,8 +138,85 @@ namespace umd::doc
 
     };
 
-    template< typename SV, typename C, typename S >
-    void process( SV string, C char_cb, S seg_cb )
+    /* A set of characters, used to find the characters that need the
+     * attention of a char_cb (see process below) and skip over the rest in
+     * bulk. Characters below ‹dense› are looked up in a table, the rest in a
+     * short sorted vector. Unless the set contains ASCII letters or digits,
+     * of which most text consists, runs of those are skipped 4 at a time. */
+
+    struct charset
+    {
+        static constexpr char32_t dense = 0x3000;
+
+        std::array< bool, dense > _dense{};
+        std::vector< char32_t > _sparse;
+        bool _alnum = false;
+
+        charset( std::u32string_view chars ) { add( chars ); }
+
+        charset operator+( std::u32string_view chars ) const
+        {
+            charset r = *this;
+            r.add( chars );
+            return r;
+        }
+
+        void add( std::u32string_view chars )
+        {
+            for ( char32_t c : chars )
+                if ( c < dense )
+                    _dense[ c ] = true, _alnum = _alnum || ( c < 0x80 && std::isalnum( c ) );
+                else
+                    _sparse.insert( std::lower_bound( _sparse.begin(), _sparse.end(), c ), c );
+        }
+
+        bool has( char32_t c ) const
+        {
+            return c < dense ? _dense[ c ] : std::binary_search( _sparse.begin(), _sparse.end(), c );
+        }
+
+        /* the position of the first member of the set in ‹s›, starting from
+         * ‹i›, or s.size() if there is none */
+        size_t next( std::u32string_view s, size_t i ) const
+        {
+            while ( i < s.size() )
+            {
+#ifdef __SSE2__
+                if ( !_alnum && s.size() - i >= 4 )
+                {
+                    auto v = _mm_loadu_si128( reinterpret_cast< const __m128i * >( s.data() + i ) );
+                    auto in = [&]( __m128i x, int lo, int n ) /* lo <= x < lo + n */
+                    {
+                        auto d = _mm_sub_epi32( x, _mm_set1_epi32( lo ) );
+                        return _mm_and_si128( _mm_cmpgt_epi32( d, _mm_set1_epi32( -1 ) ),
+                                              _mm_cmplt_epi32( d, _mm_set1_epi32( n ) ) );
+                    };
+                    auto alpha = in( _mm_or_si128( v, _mm_set1_epi32( 0x20 ) ), 'a', 26 );
+
+                    if ( _mm_movemask_epi8( _mm_or_si128( alpha, in( v, '0', 10 ) ) ) == 0xffff )
+                    {
+                        i += 4;
+                        continue;
+                    }
+                }
+#endif
+                if ( has( s[ i ] ) )
+                    return i;
+                ++ i;
+            }
+
+            return s.size();
+        }
+    };
+
+    /* Split ‹string› into segments, passed to ‹seg_cb›, around the characters
+     * for which ‹char_cb› calls ‹flush› (which ends the current segment, the
+     * last ‹n› characters excluded). Only the characters at the positions
+     * returned by ‹next› (given the string and the position to start from)
+     * are passed to ‹char_cb›; the others are left alone. */
+
+    template< typename SV, typename N, typename C, typename S >
+    void process( SV string, N next, C char_cb, S seg_cb )
     {
         int start = 0, end;
 
@@ -68,9 +238,11 @@ namespace umd::doc
             return seg;
         };
 
-        for ( end = 0; end < int( string.size() ); ++end )
+        for ( end = next( string, 0 ); end < int( string.size() ); end = next( string, end + 1 ) )
             char_cb( flush, string[ end ] );
 
+        end = string.size();
+
         if ( end > start )
             seg_cb( string.substr( start, end ) );
     }
@@ -79,7 +251,7 @@ namespace umd::doc
     void stream::emit( const T &t, const Ts & ... ts )
     {
         if ( _buffer.empty() )
-            ostr << t;
+            put( t );
         else
             _buffers[ _buffer ] << t;
 
@@ -132,6 +304,14 @@ namespace umd::doc
         virtual void mpost_write( std::string_view ) = 0;
         virtual void mpost_stop() = 0;
 
+        /* pictures drawn directly as svg (if svg_pictures says so), instead
+         * of going through metapost; the text of labels goes through text()
+         * and the span calls */
+        virtual bool svg_pictures() { return false; }
+        virtual void svg_start() {}
+        virtual void svg_write( std::string_view ) {}
+        virtual void svg_stop() {}
+
         /* tables */
         virtual void table_start( columns, bool = false ) = 0;
         virtual void table_new_cell( int ) = 0;
@@ -4,12 +4,20 @@
 #include "doc/w_lnotes.hpp"
 #include "doc/w_paper.hpp"
 #include "doc/w_html.hpp"
-#include <fstream>
+#include "doc/sections.hpp"
+#include "doc/reader.hpp"
 #include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <optional>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <fcntl.h>
 
 using namespace umd;
 
-struct w_doctype : doc::w_noop
+struct w_doctype final : doc::w_noop
 {
     std::u32string type;
 
@@ -20,33 +28,101 @@ struct w_doctype : doc::w_noop
     }
 };
 
+template< typename run_t >
+void output( std::string outfn, run_t run )
+{
+    int fd = outfn == "-" ? 1 : open( outfn.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+
+    if ( fd < 0 )
+        throw std::system_error( errno, std::generic_category(), "opening " + outfn );
+
+    doc::stream out( fd );
+    run( out );
+    out.sync();
+
+    if ( fd != 1 )
+        close( fd );
+}
+
+struct options
+{
+    std::u32string doctype;
+    std::string embed, output = "-", cache, pic_cache, batch;
+    int jobs = 1;
+    bool stream = false, profile = false, highlight = false;
+    pic::cache *pics = nullptr;
+    doc::reader *input = nullptr; /* set when streaming */
+};
+
 template< typename writer, typename... args_t >
-void convert( std::string outfn, std::u32string_view buf, args_t... args )
+void convert( const options &opt, std::u32string_view buf, args_t... args )
 {
-    std::unique_ptr< std::ofstream > file( outfn == "-" ? nullptr : new std::ofstream( outfn.c_str() ) );
-    doc::stream out( file ? *file : std::cout );
-    writer w( out, args... );
-    doc::convert conv( buf, w );
-    conv.run();
+    output( opt.output, [&]( doc::stream &out )
+    {
+        if ( opt.input )
+            return doc::convert_stream< writer >( *opt.input, out, opt.pics, args... );
+
+        writer w( out, args... );
+
+        if ( opt.profile ) /* the probes go between the converter and the writer */
+        {
+            doc::w_profile prof( w, out );
+            doc::convert<> conv( buf, prof );
+            conv._pic_cache = opt.pics;
+            conv._profile = &prof;
+            conv.run();
+        }
+        else
+        {
+            doc::convert conv( buf, w );
+            conv._pic_cache = opt.pics;
+            conv.run();
+        }
+    } );
 }
 
-int doctype( std::u32string_view buf, std::u32string dt, std::string embed, std::string out )
+void convert_html( const options &opt, std::u32string_view buf )
+{
+    auto run = [&]( doc::part_cache *cache )
+    {
+        output( opt.output, [&]( doc::stream &out )
+        {
+            doc::convert_html_sections( out, buf, opt.embed, opt.highlight, opt.jobs, cache, opt.pics );
+        } );
+    };
+
+    if ( opt.input || opt.profile ) /* sections need the entire document */
+        convert< doc::w_html >( opt, buf, opt.embed, opt.highlight );
+    else if ( !opt.cache.empty() )
+    {
+        doc::part_cache cache( opt.cache );
+        run( &cache );
+        cache.save();
+    }
+    else if ( opt.jobs > 1 )
+        run( nullptr );
+    else
+        convert< doc::w_html >( opt, buf, opt.embed, opt.highlight );
+}
+
+int doctype( std::u32string_view buf, options opt )
 {
     w_doctype wdt;
+    auto &dt = opt.doctype;
 
     if ( dt.empty() )
     {
-        doc::convert conv( buf, wdt );
+        doc::convert<> conv( buf, wdt, std::make_shared< doc::convert_base::footnotes >() );
         conv.header();
         dt = wdt.type;
     }
 
-    if      ( dt == U"slides" )   convert< doc::w_slides >( out, buf );
-    else if ( dt == U"lnotes" )   convert< doc::w_lnotes >( out, buf );
-    else if ( dt == U"workbook" ) convert< doc::w_context >( out, buf );
-    else if ( dt == U"plain" )    convert< doc::w_context >( out, buf );
-    else if ( dt == U"html" )     convert< doc::w_html >( out, buf, embed );
-    else if ( dt == U"paper" )    convert< doc::w_paper >( out, buf );
+    if      ( dt == U"slides" )   convert< doc::w_slides >( opt, buf );
+    else if ( dt == U"lnotes" )   convert< doc::w_lnotes >( opt, buf );
+    else if ( dt == U"workbook" ) convert< doc::w_context >( opt, buf );
+    else if ( dt == U"plain" )    convert< doc::w_context >( opt, buf );
+    else if ( dt == U"html" )     convert_html( opt, buf );
+    else if ( dt == U"paper" )    convert< doc::w_paper >( opt, buf );
     else
     {
         std::cerr << "unknown document type " << to_utf8( dt ) << std::endl;
@@ -56,31 +132,183 @@ int doctype( std::u32string_view buf, std::u32string dt, std::string embed, std:
     return 0;
 }
 
+int single( const char *fn, options opt )
+{
+    if ( opt.stream && !opt.profile ) /* profiling works on the entire document */
+    {
+        int fd = fn ? open( fn, O_RDONLY ) : 0;
+
+        if ( fd < 0 )
+            throw std::system_error( errno, std::generic_category(), std::string( "opening " ) + fn );
+
+        doc::reader in( fd );
+        opt.input = &in;
+        int rv = doctype( in.header(), opt );
+
+        if ( fd )
+            close( fd );
+        return rv;
+    }
+
+    std::u32string buf;
+
+    if ( fn )
+        buf = read_file( fn );
+    else
+        buf = read_file( std::cin );
+
+    return doctype( buf, opt );
+}
+
+/* Convert all the documents listed in a manifest, using a pool of ‹jobs›
+ * threads. Each line of the manifest gives an input file, an output file
+ * and optionally the document type (otherwise taken from the header),
+ * separated by white space; empty lines and lines that start with ‹#› are
+ * skipped. Each document is converted exactly as it would be by itself,
+ * and the time it took is reported on stderr once all are done. */
+
+int batch( options opt )
+{
+    struct job
+    {
+        std::string in, out, error;
+        std::u32string doctype;
+        int rv = 0;
+        double ms = 0;
+    };
+
+    std::ifstream manifest( opt.batch );
+    std::vector< job > jobs;
+
+    if ( !manifest )
+        throw std::system_error( errno, std::generic_category(), "opening " + opt.batch );
+
+    for ( std::string line; std::getline( manifest, line ); )
+    {
+        std::istringstream fields( line );
+        std::string dt;
+        job j;
+
+        if ( !( fields >> j.in ) || j.in[ 0 ] == '#' )
+            continue;
+        if ( !( fields >> j.out ) )
+            return std::cerr << opt.batch << ": no output file for " << j.in << std::endl, 1;
+        if ( fields >> dt )
+            j.doctype = from_utf8( dt );
+
+        jobs.push_back( std::move( j ) );
+    }
+
+    auto run = [&]( job &j )
+    {
+        using clock = std::chrono::steady_clock;
+        auto start = clock::now();
+        options o = opt;
+
+        o.output = j.out;
+        o.jobs = 1; /* the documents are converted in parallel instead */
+        o.cache.clear(); /* each part cache belongs to a single document */
+
+        if ( !j.doctype.empty() )
+            o.doctype = j.doctype;
+
+        try
+        {
+            if ( access( j.in.c_str(), R_OK ) )
+                throw std::system_error( errno, std::generic_category(), "opening " + j.in );
+
+            j.rv = single( j.in.c_str(), o );
+        }
+        catch ( const std::exception &e )
+        {
+            j.error = e.what();
+            j.rv = 1;
+        }
+
+        j.ms = std::chrono::duration< double, std::milli >( clock::now() - start ).count();
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::atomic< size_t > next = 0;
+    std::vector< std::thread > pool;
+
+    for ( int i = 0; i < std::min( opt.jobs, int( jobs.size() ) ); ++i )
+        pool.emplace_back( [&]
+        {
+            for ( size_t k; ( k = next++ ) < jobs.size(); )
+                run( jobs[ k ] );
+        } );
+
+    for ( auto &t : pool )
+        t.join();
+
+    int failed = 0;
+    std::cerr << std::fixed << std::setprecision( 1 );
+
+    for ( auto &j : jobs )
+    {
+        std::cerr << j.in << ": ";
+        if ( j.rv )
+            std::cerr << "failed" << ( j.error.empty() ? "" : ": " ) << j.error << std::endl, ++ failed;
+        else
+            std::cerr << j.ms << " ms" << std::endl;
+    }
+
+    std::chrono::duration< double, std::milli > total = std::chrono::steady_clock::now() - start;
+    std::cerr << jobs.size() << " documents in " << total.count() << " ms";
+    std::cerr << ( failed ? ", " + std::to_string( failed ) + " failed" : "" ) << std::endl;
+
+    return failed ? 1 : 0;
+}
+
 int main( int argc, const char **argv )
 {
     if ( argc < 2 )
         return std::cerr << "need at least one (file) argument" << std::endl, 1;
 
-    std::u32string dt;
+    options opt;
     const char *fn = argv[ 1 ];
-    std::string embed, out = "-";
 
     for ( int i = 1; i < argc; ++i )
     {
         if ( argv[ i ] == std::string( "--html" ) )
-            dt = U"html", fn = argv[ i + 1 ];
+            opt.doctype = U"html", fn = argv[ i + 1 ];
         if ( argv[ i ] == std::string( "--embed" ) )
-            embed = argv[ i + 1 ], fn = argv[ i + 2 ];
+            opt.embed = argv[ i + 1 ], fn = argv[ i + 2 ];
         if ( argv[ i ] == std::string( "-o" ) )
-            out = argv[ i + 1 ], fn = argv[ i + 2 ];
+            opt.output = argv[ i + 1 ], fn = argv[ i + 2 ];
+        if ( argv[ i ] == std::string( "-j" ) ) /* html output and --batch */
+            opt.jobs = std::stoi( argv[ i + 1 ] ), fn = argv[ i + 2 ];
+        if ( argv[ i ] == std::string( "--cache" ) ) /* likewise */
+            opt.cache = argv[ i + 1 ], fn = argv[ i + 2 ];
+        if ( argv[ i ] == std::string( "--pic-cache" ) )
+            opt.pic_cache = argv[ i + 1 ], fn = argv[ i + 2 ];
+        if ( argv[ i ] == std::string( "--stream" ) )
+            opt.stream = true, fn = argv[ i + 1 ];
+        if ( argv[ i ] == std::string( "--batch" ) )
+            opt.batch = argv[ i + 1 ], fn = argv[ i + 2 ];
+        if ( argv[ i ] == std::string( "--profile" ) )
+            opt.profile = true, fn = argv[ i + 1 ];
+        if ( argv[ i ] == std::string( "--highlight" ) ) /* html: no highlight.js */
+            opt.highlight = true, fn = argv[ i + 1 ];
     }
 
-    std::u32string buf;
+    std::optional< pic::cache > pics;
 
-    if ( fn )
-        buf = read_file( fn );
-    else
-        buf = read_file( std::cin );
+    if ( !opt.pic_cache.empty() )
+        opt.pics = &pics.emplace( opt.pic_cache );
+
+    int rv = opt.batch.empty() ? single( fn, opt ) : batch( opt );
+
+    if ( pics && ( rv == 0 || pics->_hits || pics->_misses ) )
+    {
+        pics->save();
+        std::cerr << "pictures: " << pics->_hits << " cached, "
+                  << pics->_misses << " converted" << std::endl;
+    }
+
+    if ( opt.profile )
+        doc::profile::print( std::cerr );
 
-    return doctype( buf, dt, embed, out );
+    return rv;
 }
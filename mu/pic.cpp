@@ -5,32 +5,195 @@
 #include "pic/convert.hpp"
 #include "doc/writer.hpp"
 
-#include <fstream>
+#include <algorithm>
 #include <iostream>
+#include <iomanip>
+#include <deque>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <cstring>
+#include <cerrno>
 
 using namespace umd;
 
 struct writer : pic::writer, doc::stream
 {
-    writer( std::ostream &o ) : doc::stream( o ) {}
+    writer( int fd ) : doc::stream( fd ) {}
     void emit_mpost( std::string_view s ) { emit( s ); }
     void emit_tex( std::u32string_view s ) { emit( s ); }
 };
 
-int main( int, const char **argv )
+struct diagram
 {
-    std::cout << "color fg; fg := black;" << std::endl;
-    std::cout << "beginfig(1)" << std::endl;
-    std::cout << "pickup pencircle scaled .3mm;" << std::endl;
+    std::string input;
+    std::u32string_view text;
+    std::string mpost = {}, error = {};
+    size_t cells = 0; /* characters in the input, not counting newlines */
+};
+
+/* A stream may hold any number of diagrams, separated by empty lines. Each
+ * keeps the newline of its last line, so that it converts exactly as it
+ * would from a file of its own. */
+
+static void split( std::string input, std::u32string_view buf, std::vector< diagram > &out )
+{
+    size_t start = 0;
+
+    for ( size_t i = 0; i < buf.size(); )
+    {
+        size_t eol = std::min( buf.find( U'\n', i ), buf.size() );
+
+        if ( eol == i )
+        {
+            if ( i > start )
+                out.push_back( { input, buf.substr( start, i - start ) } );
+            start = eol + 1;
+        }
+
+        i = eol + 1;
+    }
+
+    if ( start < buf.size() )
+        out.push_back( { input, buf.substr( start ) } );
+}
+
+/* Why the file at ‹path› cannot be read, or an empty string if it can. */
+
+static std::string unreadable( const char *path )
+{
+    int fd = open( path, O_RDONLY );
+    struct stat st;
+    std::string why;
+
+    if ( fd < 0 || fstat( fd, &st ) )
+        why = strerror( errno );
+    else if ( S_ISDIR( st.st_mode ) )
+        why = strerror( EISDIR );
+
+    if ( fd >= 0 )
+        close( fd );
+
+    return why;
+}
+
+/* Convert each file given on the command line into a figure of a single
+ * MetaPost file, numbered in the order of the inputs; ‹-› reads a stream of
+ * diagrams from stdin. The figures are converted by a pool of ‹-j› threads
+ * and written out once they are all done. A file that cannot be read counts
+ * as a diagram that failed: it is reported on stderr, its figure is left out
+ * and the exit status is 1. With ‹-t›, the throughput of the conversion is
+ * reported on stderr. */
+
+int main( int argc, char **argv )
+{
+    int jobs = std::max( 1u, std::thread::hardware_concurrency() );
+    bool timing = false;
+    int ch;
+
+    while ( ( ch = getopt( argc, argv, "j:t" ) ) != -1 )
+        switch ( ch )
+        {
+            case 'j':
+                jobs = std::max( 1, atoi( optarg ) );
+                break;
+            case 't':
+                timing = true;
+                break;
+            default:
+                std::cerr << "usage: " << argv[ 0 ] << " [-j jobs] [-t] file|- ..." << std::endl;
+                return 1;
+        }
+
+    if ( optind == argc )
+        return std::cerr << "need at least one (file) argument" << std::endl, 1;
+
+    std::deque< std::u32string > buffers; /* the diagrams point into these */
+    std::vector< diagram > diagrams;
+
+    for ( int i = optind; i < argc; ++i )
+        if ( argv[ i ] == std::string( "-" ) )
+            split( "stdin", buffers.emplace_back( read_file( std::cin ) ), diagrams );
+        else if ( auto why = unreadable( argv[ i ] ); !why.empty() )
+            diagrams.push_back( { argv[ i ], {}, {}, "cannot read the file: " + why } );
+        else
+            try
+            {
+                diagrams.push_back( { argv[ i ], buffers.emplace_back( read_file( argv[ i ] ) ) } );
+            }
+            catch ( const std::exception &e )
+            {
+                diagrams.push_back( { argv[ i ], {}, {}, e.what() } );
+            }
+
+    auto run = [&]( diagram &d )
+    {
+        if ( !d.error.empty() ) /* the input could not be read */
+            return;
+
+        try
+        {
+            auto grid = pic::reader::read_grid( d.text );
+            auto scene = pic::convert::scene( grid );
+            writer out( -1 );
+
+            scene.emit( out );
+            d.mpost = out.data();
+            d.cells = d.text.size() - std::count( d.text.begin(), d.text.end(), U'\n' );
+        }
+        catch ( const std::exception &e )
+        {
+            d.error = e.what();
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::atomic< size_t > next = 0;
+    std::vector< std::thread > pool;
+
+    for ( int i = 0; i < std::min( jobs, int( diagrams.size() ) ); ++i )
+        pool.emplace_back( [&]
+        {
+            for ( size_t k; ( k = next++ ) < diagrams.size(); )
+                run( diagrams[ k ] );
+        } );
+
+    for ( auto &t : pool )
+        t.join();
+
+    std::chrono::duration< double > total = std::chrono::steady_clock::now() - start;
+    writer w( 1 );
+    int failed = 0;
+    size_t cells = 0;
+
+    w.emit( "color fg; fg := black;\n" );
+
+    for ( size_t i = 0; i < diagrams.size(); ++i )
+    {
+        auto &d = diagrams[ i ];
+
+        if ( !d.error.empty() )
+        {
+            std::cerr << d.input << ": figure " << i + 1 << " failed: " << d.error << std::endl;
+            ++ failed;
+            continue;
+        }
+
+        w.emit( "beginfig(", i + 1, ")\n" );
+        w.emit( "pickup pencircle scaled .3mm;\n" );
+        w.emit( d.mpost );
+        w.emit( "endfig\n" );
+        cells += d.cells;
+    }
 
-    std::ifstream f( argv[1] );
-    auto buf = read_file( f );
-    auto grid = pic::reader::read_grid( buf );
+    w.emit( "end\n" );
 
-    auto scene = pic::convert::scene( grid );
-    writer w( std::cout );
-    scene.emit( w );
+    if ( timing )
+        std::cerr << std::fixed << std::setprecision( 1 )
+                  << diagrams.size() << " diagrams, " << cells << " cells in "
+                  << total.count() * 1000 << " ms: "
+                  << std::setprecision( 0 ) << diagrams.size() / total.count() << " diagrams/s, "
+                  << cells / total.count() << " cells/s" << std::endl;
 
-    std::cout << "endfig" << std::endl;
-    std::cout << "end" << std::endl;
+    return failed ? 1 : 0;
 }
@@ -0,0 +1,200 @@
+#pragma once
+#include "writer.hpp"
+#include "scene.hpp"
+#include <brick-hash>
+#include <map>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <fstream>
+#include <cstdio>
+#include <stdexcept>
+
+namespace umd::pic
+{
+    /* A recorded sequence of writer calls, which can be replayed into another
+     * writer. Since a scene only talks to its writer through emit_mpost and
+     * emit_tex, replaying the recording gives exactly the same result as
+     * emitting the scene again, whatever the writer does with it. Consecutive
+     * emit_mpost calls are merged (all the writers simply append). */
+
+    struct recording : writer
+    {
+        struct call
+        {
+            bool is_tex;
+            std::string mpost;
+            std::u32string tex;
+        };
+
+        std::vector< call > calls;
+
+        void emit_mpost( std::string_view s ) override
+        {
+            if ( calls.empty() || calls.back().is_tex )
+                calls.push_back( { false, std::string( s ), {} } );
+            else
+                calls.back().mpost += s;
+        }
+
+        void emit_tex( std::u32string_view s ) override { calls.push_back( { true, {}, std::u32string( s ) } ); }
+
+        void replay( writer &w ) const
+        {
+            for ( const auto &c : calls )
+                if ( c.is_tex )
+                    w.emit_tex( c.tex );
+                else
+                    w.emit_mpost( c.mpost );
+        }
+    };
+
+    /* A persistent cache of scenes, as recordings, keyed by a hash of the
+     * picture source text. It is loaded from ‹file› when constructed, and
+     * save() writes back the entries that were used in this run. Lookups and
+     * inserts may come from multiple threads. A missing or malformed file is
+     * the same as an empty cache, and so is one written with a different
+     * output_version (which follows the magic). */
+
+    struct cache
+    {
+        using key = std::pair< uint64_t, uint64_t >;
+        static constexpr std::string_view magic = "mu picture cache 2\n";
+
+        std::string _file;
+        std::map< key, recording > _stored, _used;
+        std::mutex _mutex;
+        int _hits = 0, _misses = 0;
+
+        static key make_key( std::u32string_view text )
+        {
+            auto bytes = reinterpret_cast< const uint8_t * >( text.data() );
+            size_t size = text.size() * sizeof( char32_t );
+            brq::hash_state a( 0 ), b( 1 );
+
+            for ( auto *s : { &a, &b } )
+                for ( size_t done = 0; done < size; done += 1 << 30 )
+                    s->update_aligned< true >( bytes + done, std::min( size - done, size_t( 1 ) << 30 ) );
+
+            return { a.hash(), b.hash() };
+        }
+
+        cache( std::string file ) : _file( file )
+        {
+            std::ifstream in( file, std::ios::binary );
+            std::string buf( magic.size(), 0 );
+
+            auto get = [&]( auto &v ) { return bool( in.read( reinterpret_cast< char * >( &v ), sizeof( v ) ) ); };
+            uint32_t version;
+
+            if ( !in.read( buf.data(), buf.size() ) || buf != magic ||
+                 !get( version ) || version != output_version )
+                return;
+
+            auto get_str = [&]( auto &s )
+            {
+                uint32_t size;
+                if ( !get( size ) )
+                    return false;
+                s.resize( size );
+                return bool( in.read( reinterpret_cast< char * >( s.data() ), size * sizeof( s[ 0 ] ) ) );
+            };
+
+            auto entry = [&]( recording &r )
+            {
+                uint32_t count;
+
+                if ( !get( count ) )
+                    return false;
+
+                r.calls.resize( count );
+                for ( auto &c : r.calls )
+                {
+                    uint8_t is_tex;
+                    if ( !get( is_tex ) || !get_str( c.mpost ) || !get_str( c.tex ) )
+                        return false;
+                    c.is_tex = is_tex;
+                }
+
+                return true;
+            };
+
+            try
+            {
+                for ( key k; get( k ); )
+                    if ( recording r; entry( r ) )
+                        _stored.emplace( k, std::move( r ) );
+                    else
+                        throw std::runtime_error( "truncated" );
+
+                if ( in.gcount() ) /* a partial key */
+                    throw std::runtime_error( "truncated" );
+            }
+            catch ( const std::exception & ) /* also a bad_alloc from a garbled size */
+            {
+                _stored.clear();
+            }
+        }
+
+        /* the returned recording stays valid until the cache is destroyed */
+        const recording *find( std::u32string_view text )
+        {
+            auto k = make_key( text );
+            std::lock_guard _( _mutex );
+
+            if ( auto i = _used.find( k ); i != _used.end() )
+                return ++ _hits, &i->second;
+
+            auto i = _stored.find( k );
+            if ( i == _stored.end() )
+                return ++ _misses, nullptr;
+
+            auto j = _used.emplace( k, std::move( i->second ) ).first;
+            _stored.erase( i );
+            return ++ _hits, &j->second;
+        }
+
+        /* if another thread got there first, its recording stays: it may be
+         * getting replayed by now (see find) */
+        void insert( std::u32string_view text, recording r )
+        {
+            auto k = make_key( text );
+            std::lock_guard _( _mutex );
+            _used.try_emplace( k, std::move( r ) );
+        }
+
+        /* written into a temporary file first, so that an interrupted run does
+         * not leave a truncated cache behind */
+        void save()
+        {
+            if ( !_misses && _stored.empty() )
+                return;
+
+            std::string tmp = _file + ".tmp";
+            std::ofstream out( tmp, std::ios::binary | std::ios::trunc );
+            auto put = [&]( const auto &v ) { out.write( reinterpret_cast< const char * >( &v ), sizeof( v ) ); };
+
+            auto put_str = [&]( const auto &s )
+            {
+                put( uint32_t( s.size() ) );
+                out.write( reinterpret_cast< const char * >( s.data() ), s.size() * sizeof( s[ 0 ] ) );
+            };
+
+            out.write( magic.data(), magic.size() );
+            put( output_version );
+
+            for ( const auto &[ k, r ] : _used )
+            {
+                put( k );
+                put( uint32_t( r.calls.size() ) );
+                for ( const auto &c : r.calls )
+                    put( uint8_t( c.is_tex ) ), put_str( c.mpost ), put_str( c.tex );
+            }
+
+            out.close();
+
+            if ( !out || std::rename( tmp.c_str(), _file.c_str() ) )
+                std::remove( tmp.c_str() );
+        }
+    };
+}
@@ -2,10 +2,10 @@
 
 #include "scene.hpp"
 #include "reader.hpp"
-#include "util.hpp"
 
+#include <algorithm>
 #include <array>
-#include <set>
+#include <vector>
 
 namespace umd::pic::convert
 {
@@ -25,17 +25,32 @@ namespace umd::pic::convert
         }
     }
 
-    struct object_map : std::map< reader::point, std::shared_ptr< pic::object > >
+    /* Data attached to the cells of a grid, in an array laid out like the
+     * grid itself (see reader::padded). */
+
+    template< typename T >
+    struct cell_map : reader::padded< T >
     {
-        // object_ptr at( int x, int y ) const { return at( point( x, y ) ); }
+        cell_map( const reader::grid &g ) : reader::padded< T >( g._width, g._height ) {}
 
-        std::shared_ptr< pic::object > at( reader::point p ) const
-        {
-            if ( auto i = find( p ) ; i != end() )
-                return i->second;
-            else
-                return nullptr;
-        }
+        T get( reader::point p ) const { return this->_data[ this->index( p.x(), p.y() ) ]; }
+        void set( reader::point p, T v ) { this->_data[ this->index( p.x(), p.y() ) ] = v; }
+    };
+
+    /* the object that covers each cell, if any */
+    struct object_map : cell_map< pic::object * >
+    {
+        using cell_map::cell_map;
+        pic::object *at( reader::point p ) const { return get( p ); }
+    };
+
+    /* the cells that were already taken up by something, as a bitmap */
+    struct point_set : cell_map< bool >
+    {
+        using cell_map::cell_map;
+        bool count( reader::point p ) const { return get( p ); }
+        void insert( reader::point p ) { set( p, true ); }
+        void emplace( int x, int y ) { insert( reader::point( x, y ) ); }
     };
 
     struct state
@@ -43,11 +58,11 @@ namespace umd::pic::convert
         object_map objects;
         pic::group group;
         const reader::grid &grid;
-        std::set< reader::point > processed;
+        point_set processed;
 
         static constexpr double xpitch = 4.5, ypitch = 9;
 
-        state( const reader::grid &g ) : grid( g ) {}
+        state( const reader::grid &g ) : objects( g ), grid( g ), processed( g ) {}
 
         void arrow( int x, int y ) { arrow( reader::point( x, y ) ); }
         void arrow( reader::point p )
@@ -77,7 +92,7 @@ namespace umd::pic::convert
             if ( to_obj && ( !grid[ to ].attach( opposite( to_dir ) ) || grid[ to ].node() ) )
                 to_port = to_obj->port( opposite( to_dir ) );
 
-            std::shared_ptr< pic::object > from_obj = nullptr;
+            pic::object *from_obj = nullptr;
 
             while ( true )
             {
@@ -124,10 +139,12 @@ namespace umd::pic::convert
             std::copy( points.rbegin(), points.rend(), std::back_inserter( arrow._controls ) );
         }
 
-        std::pair< reader::point, int > boundary( reader::point p, dir_t dir, int joins = 1,
-                                                  bool jcw = true, bool *dashed = nullptr )
+        /* Walk an edge of a box from its corner until the first junction
+         * that turns inwards (or a node ends the line). Each walk is linear
+         * in the length of the edge. */
+
+        reader::point boundary( reader::point p, dir_t dir, bool jcw = true, bool *dashed = nullptr )
         {
-            int joined = 0;
             bool first = true;
 
             for ( ; grid[ p ].attach( dir ); p = p + diff( dir ) )
@@ -143,23 +160,23 @@ namespace umd::pic::convert
 
                 if ( ( !jcw && grid[ p ].attach( cw( dir ) ) ) ||
                      ( jcw && grid[ p ].attach( ccw( dir ) ) ) )
-                    if ( ++joined == joins )
-                        break;
+                    break;
 
                 if ( grid[ p + diff( dir ) ].node() )
                     break;
             }
 
-            return { p, joined };
+            return p;
         }
 
-        using joins = std::array< int, 4 >;
-        using box_ptr = std::shared_ptr< pic::box >;
+        /* Every cell is tried as the north-west corner of a box at most once
+         * (guarded by ‹processed›), and a failed attempt only costs the four
+         * edge walks, so detection is linear in the size of the picture
+         * (boxes nested k deep scan their interior k times). */
 
-        box_ptr box( reader::point p, joins mj = { 1, 1, 1, 1 } )
+        pic::box *box( reader::point p )
         {
             std::array< reader::point, 4 > c;
-            joins j;
             bool dashed[ 4 ] = { false };
 
             if ( processed.count( p ) )
@@ -171,29 +188,18 @@ namespace umd::pic::convert
                 return nullptr;
 
             auto nw = p;
-            auto [ ne, jn ] = boundary( p, east,   mj[ 0 ], false, dashed + 0 );
-            auto [ sw, je ] = boundary( p, south,  mj[ 1 ], true,  dashed + 3 );
-            auto [ se, jw ] = boundary( ne, south, mj[ 2 ], false, dashed + 1 );
-            auto [ sx, js ] = boundary( sw, east,  mj[ 3 ], true,  dashed + 2 );
+            auto ne = boundary( p, east,   false, dashed + 0 );
+            auto sw = boundary( p, south,  true,  dashed + 3 );
+            auto se = boundary( ne, south, false, dashed + 1 );
+            auto sx = boundary( sw, east,  true,  dashed + 2 );
 
-            c[ corner_ne ] = ne; j[ 0 ] = jn;
-            c[ corner_nw ] = nw; j[ 1 ] = je;
-            c[ corner_se ] = se; j[ 2 ] = jw;
-            c[ corner_sw ] = sw; j[ 3 ] = js;
+            c[ corner_ne ] = ne;
+            c[ corner_nw ] = nw;
+            c[ corner_se ] = se;
+            c[ corner_sw ] = sw;
 
             if ( se != sx )
-            {
-                auto idx = index_sort( mj );
-                for ( auto i : idx )
-                    if ( mj[ i ] == j[ i ] )
-                    {
-                        mj[ i ] ++;
-                        return box( p, mj );
-                        mj[ i ] --;
-                    }
-
                 return nullptr; /* not a box */
-            }
 
             double w = ne.x() - nw.x();
             double h = sw.y() - nw.y();
@@ -253,7 +259,7 @@ namespace umd::pic::convert
                         last_x = x, last_y = y;
                     }
 
-                    objects[ reader::point( x, y ) ] = obj;
+                    objects.set( reader::point( x, y ), obj );
                     processed.emplace( x, y );
                 }
 
@@ -279,7 +285,7 @@ namespace umd::pic::convert
             {
                 auto node = group.add< pic::node >( xpitch * p.x(), -ypitch * p.y(), 2 );
                 node->_shade = c.shade();
-                objects[ p ] = node;
+                objects.set( p, node );
             }
 
             if ( c.attach( south ) && c.attach( east ) )
@@ -292,7 +298,7 @@ namespace umd::pic::convert
             auto c = grid.at( p );
 
             for ( auto dir : all_dirs )
-                if ( c.attach( dir ) && objects.count( p + diff( dir ) ) )
+                if ( c.attach( dir ) && objects.at( p + diff( dir ) ) )
                 {
                     arrow( p, dir );
                     break;
@@ -323,7 +329,7 @@ namespace umd::pic::convert
                                                ypitch * ( - p.y() ), txt );
             while ( p != origin ) /* fixme off by one */
             {
-                objects[ p ] = obj;
+                objects.set( p, obj );
                 processed.insert( p );
                 p = p + reader::point( -1, 0 );
             }
@@ -359,6 +365,6 @@ namespace umd::pic::convert
             throw;
         }
 
-        return s.group;
+        return std::move( s.group );
     }
 }
@@ -4,7 +4,9 @@
 #include "types.hpp"
 
 #include <map>
-#include <bitset>
+#include <vector>
+#include <tuple>
+#include <bit>
 #include <brick-except>
 
 namespace umd::pic
@@ -33,14 +35,17 @@ namespace umd::pic::reader
         point operator+( point o ) { return point( x() + o.x(), y() + o.y() ); }
     };
 
+    /* A cell of the grid, packed into 8 bytes: the character, the attachment
+     * and arrow directions as bitmasks (indexed by dir_t) and the flags. */
+
     struct cell
     {
         char32_t _char = U' ';
-        std::bitset< 8 > _attach, _arrow;
-        bool _rounded = false;
-        bool _dashed = false;
-        bool _head = false;
-        int _shade = 0; /* 0 = empty, 4 = full */
+        uint8_t _attach = 0, _arrow = 0;
+        bool _rounded : 1 = false;
+        bool _dashed : 1 = false;
+        bool _head : 1 = false;
+        uint8_t _shade = 0; /* 0 = empty, 4 = full */
 
         bool text() const { return ( _char < 0x2500 || _char > 0x2580 ) &&
                                    !attach() && !arrow() && !empty(); }
@@ -48,41 +53,35 @@ namespace umd::pic::reader
         bool node() const { return _char == U'●' || _char == U'○'; }
         bool rounded() const { return _rounded; }
         bool dashed() const { return _dashed; }
-        bool attach( dir_t dir ) const { return _attach[ dir ]; }
-        bool attach() const { return _attach.any(); }
+        bool attach( dir_t dir ) const { return _attach & bit( dir ); }
+        bool attach() const { return _attach; }
         bool head() const { return _head; }
         int shade() const { return _shade; }
 
         char32_t character() const { return _char; }
-        bool attach_all() const { return _attach.count() == 4; } /* FIXME */
+        bool attach_all() const { return std::popcount( _attach ) == 4; } /* FIXME */
         dir_t attach_dir() const { return dir( _attach ); }
-        dir_t attach_dir( dir_t except ) const
-        {
-            auto mod = _attach;
-            mod[ except ] = false;
-            return dir( mod );
-        }
+        dir_t attach_dir( dir_t except ) const { return dir( _attach & ~bit( except ) ); }
 
-        bool arrow( dir_t dir ) const { return _arrow[ dir ]; }
-        bool arrow() const { return _arrow.any(); }
+        bool arrow( dir_t dir ) const { return _arrow & bit( dir ); }
+        bool arrow() const { return _arrow; }
         dir_t arrow_dir() const { return dir( _arrow ); }
 
-        dir_t dir( std::bitset< 8 > bs ) const
+        static uint8_t bit( dir_t d ) { return 1 << d; }
+
+        dir_t dir( uint8_t bs ) const
         {
-            if ( bs.count() == 0 )
+            if ( bs == 0 )
                 brq::raise< bad_picture >() << "unattached line";
 
-            if ( bs.count() > 1 )
+            if ( std::popcount( bs ) > 1 )
                 brq::raise< bad_picture >() << "ambiguous attachment";
 
-            for ( dir_t dir : all_dirs )
-                if ( bs[ dir ] )
-                    return dir;
-            assert( 0 );
+            return dir_t( std::countr_zero( bs ) );
         }
 
-        cell &set_attach( dir_t d ) { _attach[ d ] = true; return *this; }
-        cell &set_arrow( dir_t d )  { _arrow[ d ] = true; return *this; }
+        cell &set_attach( dir_t d ) { _attach |= bit( d ); return *this; }
+        cell &set_arrow( dir_t d )  { _arrow |= bit( d ); return *this; }
         cell &set_char( uint32_t c ) { _char = c; return *this; }
         cell &set_rounded( bool b ) { _rounded = b; return *this; }
         cell &set_shade( int i ) { _shade = i; return *this; }
@@ -160,57 +159,81 @@ namespace umd::pic::reader
         cell() = default;
     };
 
-    struct grid
+    static_assert( sizeof( cell ) == 8 );
+
+    /* A row-major array of ‹T› aligned with the cells of a picture of
+     * ‹_width› × ‹_height›, with a border of one cell on each side. A label
+     * ends (and an arrow may point) one cell past the edge of the picture,
+     * and nothing reaches further than that, so the coordinates from -1 to
+     * ‹_width› (resp. ‹_height›) can be used without a bounds check. */
+
+    template< typename T >
+    struct padded
+    {
+        int _width = 0, _height = 0;
+        std::vector< T > _data;
+
+        padded() = default;
+        padded( int w, int h ) : _width( w ), _height( h ), _data( size_t( w + 2 ) * ( h + 2 ) ) {}
+
+        size_t index( int x, int y ) const { return size_t( y + 1 ) * ( _width + 2 ) + x + 1; }
+    };
+
+    /* The cells of a picture, as wide as the longest line (the shorter lines
+     * are padded with empty cells, and so is the border). Iterating the grid
+     * yields ‹( x, y, cell )› for each cell of the picture proper, in
+     * row-major order. */
+
+    struct grid : padded< cell >
     {
-        int _x = 0, _y = 0;
-        std::vector< std::tuple< int, int, cell > > _iterable;
-        std::vector< std::vector< cell > > _indexable;
         std::u32string_view _raw;
 
-        grid() { _indexable.emplace_back(); }
+        using padded::padded;
 
-        void add( uint32_t c )
-        {
-            if ( c == U'\n' )
-            {
-                _indexable.emplace_back();
-                ++ _y;
-                _x = 0;
-            }
-            else
-            {
-                _iterable.emplace_back( _x++, _y, c );
-                _indexable.back().emplace_back( c );
-            }
-        }
+        const cell &at( int x, int y ) const { return _data[ index( x, y ) ]; }
+        const cell &at( point p ) const { return at( p.x(), p.y() ); }
+        const cell &operator[]( point p ) const { return at( p ); }
 
-        cell at( int x, int y ) const
+        struct iterator
         {
-            if ( x < 0 || y < 0 ) return cell();
-            if ( y >= int( _indexable.size() ) ) return cell();
-            auto &row = _indexable[ y ];
-            if ( x >= int( row.size() ) ) return cell();
-            return row[ x ];
-        }
+            const grid *g;
+            int i;
 
-        cell at( point p ) const
-        {
-            return at( p.x(), p.y() );
-        }
+            std::tuple< int, int, const cell & > operator*() const
+            {
+                int x = i % g->_width, y = i / g->_width;
+                return { x, y, g->at( x, y ) };
+            }
 
-        cell operator[]( point p ) const { return at( p ); }
+            iterator &operator++() { ++i; return *this; }
+            bool operator!=( const iterator &o ) const { return i != o.i; }
+        };
 
-        auto begin() const { return _iterable.begin(); }
-        auto end() const { return _iterable.end(); }
+        iterator begin() const { return { this, 0 }; }
+        iterator end() const { return { this, _width * _height }; }
     };
 
     static inline grid read_grid( std::u32string_view ptr )
     {
-        grid g;
+        int width = 0, height = 1;
+
+        for ( size_t i = 0, start = 0; i <= ptr.size(); ++i )
+            if ( i == ptr.size() || ptr[ i ] == U'\n' )
+            {
+                width = std::max( width, int( i - start ) );
+                height += i < ptr.size();
+                start = i + 1;
+            }
+
+        grid g( width, height );
         g._raw = ptr;
 
-        while ( !ptr.empty() )
-            g.add( ptr[0] ), ptr.remove_prefix( 1 );
+        for ( int x = 0, y = 0; char32_t c : ptr )
+            if ( c == U'\n' )
+                ++ y, x = 0;
+            else
+                g._data[ g.index( x++, y ) ] = cell( c );
+
         return g;
     }
 }
@@ -5,20 +5,48 @@
 #include "writer.hpp"
 #include <brick-string>
 
+#include <array>
 #include <memory>
+#include <memory_resource>
+#include <tuple>
 #include <vector>
 #include <bitset>
-#include <codecvt>
-#include <locale>
+#include <charconv>
 #include <cmath>
 #include <cassert>
 
 namespace umd::pic
 {
+    /* The version of the output of scenes, MetaPost and SVG alike. Cached
+     * output (see cache.hpp and doc/cache.hpp) from a different version is
+     * discarded, so bump it whenever that output changes. */
+    inline constexpr uint32_t output_version = 1;
+
+    /* the extent of (a part of) a scene, in the coordinates of the scene */
+    struct bounds
+    {
+        float x0 = INFINITY, y0 = INFINITY, x1 = -INFINITY, y1 = -INFINITY;
+
+        void add( float x, float y, float rx = 0, float ry = 0 )
+        {
+            x0 = std::min( x0, x - rx ), x1 = std::max( x1, x + rx );
+            y0 = std::min( y0, y - ry ), y1 = std::max( y1, y + ry );
+        }
+
+        bool empty() const { return x0 > x1; }
+    };
+
+    /* Each element can be emitted either as MetaPost (emit and fill) or as
+     * SVG (emit_svg and fill_svg). In both cases, the fills of an entire
+     * group go first, so that they do not cover any of the lines. */
+
     struct element
     {
         virtual void emit( writer &w ) const = 0;
         virtual void fill( writer & ) const {}
+        virtual void emit_svg( svg_writer & ) const {}
+        virtual void fill_svg( svg_writer & ) const {}
+        virtual void extend( bounds & ) const {}
         virtual ~element() {}
     };
 
@@ -34,6 +62,30 @@ namespace umd::pic
         return w;
     }
 
+    inline svg_writer &operator<<( svg_writer &w, const element &obj )
+    {
+        obj.emit_svg( w );
+        return w;
+    }
+
+    inline svg_writer &operator<<( svg_writer &w, std::string_view sv )
+    {
+        w.emit_svg( sv );
+        return w;
+    }
+
+    inline svg_writer &operator<<( svg_writer &w, float f )
+    {
+        char buf[ 32 ];
+        auto end = std::to_chars( buf, buf + sizeof( buf ), f ).ptr;
+        w.emit_svg( std::string_view( buf, end - buf ) );
+        return w;
+    }
+
+    /* the colours from tex/prelude-style.tex; fg is the colour of the text */
+    inline constexpr std::string_view svg_fg[] = { "#1a9999", "#1a1a99", "#991a1a", "#1a991a", "#99991a" };
+    inline constexpr std::string_view svg_shade[] = { "#e0e0e0", "#c2c2c2", "#a3a3a3", "#858585" };
+
     struct point : element
     {
         float x, y;
@@ -49,6 +101,12 @@ namespace umd::pic
         {
             w << "(" << std::to_string( x ) << ", " << std::to_string( y ) << ")";
         }
+
+        /* the y axis of SVG points down (and 0 - y is never a negative zero) */
+        void emit_svg( svg_writer &w ) const override
+        {
+            w << x << "," << 0 - y;
+        }
     };
 
     struct dir : element
@@ -150,6 +208,57 @@ namespace umd::pic
             o << ( _dashed ? " dashed dotted" : "" )
               << " withcolor fg_" << std::string( 1, "abcde"[ _shade ] ) << ";\n";
         }
+
+        /* The curved path above, as MetaPost draws it: the first and the last
+         * segment are straight (the midpoints lie on the line to the nearest
+         * control point) and each ‹controls c› in between is a cubic with
+         * both of its control points at ‹c›. */
+
+        void emit_svg( svg_writer &o ) const override
+        {
+            auto colour = svg_fg[ _shade ];
+            point from = _from.position(), to = _to.position(), tail = from;
+
+            o << "<path d=\"M" << from;
+
+            if ( _curved && !_controls.empty() )
+            {
+                o << " L" << ( from + _controls.front() ) / 2;
+
+                for ( auto i = _controls.begin(); i != _controls.end(); ++i )
+                {
+                    point next = std::next( i ) == _controls.end() ? to : *std::next( i );
+                    o << " C" << *i << " " << *i << " " << ( tail = ( *i + next ) / 2 );
+                }
+            }
+            else
+                for ( auto c : _controls )
+                    o << " L" << ( tail = c );
+
+            o << " L" << to << "\" stroke=\"" << colour << "\"";
+            o << ( _dashed ? " stroke-dasharray=\"1 1.5\"/>" : "/>" );
+
+            if ( !_head )
+                return;
+
+            /* the default arrowhead of MetaPost: 4bp long, 45° wide */
+            point d = to - tail;
+            d = d / std::max( std::hypot( d.x, d.y ), 1e-6f ) * 4;
+            float c = std::cos( M_PI / 8 ), s = std::sin( M_PI / 8 );
+            point l = to - point( d.x * c - d.y * s, d.x * s + d.y * c ),
+                  r = to - point( d.x * c + d.y * s, d.y * c - d.x * s );
+
+            o << "<path d=\"M" << l << " L" << to << " L" << r << "Z\" fill=\""
+              << colour << "\" stroke=\"" << colour << "\"/>";
+        }
+
+        void extend( bounds &b ) const override
+        {
+            for ( auto p : { _from.position(), _to.position() } )
+                b.add( p.x, p.y, 4, 4 );
+            for ( auto p : _controls )
+                b.add( p.x, p.y );
+        }
     };
 
     struct label : virtual element
@@ -162,11 +271,24 @@ namespace umd::pic
 
         void emit( writer &o ) const override
         {
-            std::wstring_convert< std::codecvt_utf8< char32_t >, char32_t > conv;
             o << "label( btex \\strut{}";
             o.emit_tex( _text );
             o << "\\strut etex, " << _position << ");\n";
         }
+
+        void emit_svg( svg_writer &o ) const override
+        {
+            o << "<text x=\"" << _position.x << "\" y=\"" << 0 - _position.y
+              << "\" fill=\"currentColor\" stroke=\"none\">";
+            o.emit_label( _text );
+            o << "</text>";
+        }
+
+        /* only a guess, the actual width depends on the font */
+        void extend( bounds &b ) const override
+        {
+            b.add( _position.x, _position.y, 3 * _text.size(), 6 );
+        }
     };
 
     struct object : virtual element
@@ -214,6 +336,17 @@ namespace umd::pic
               << " fullcircle scaled " << std::to_string( 2 * _radius )
               << " shifted " << _position << " withcolor fg;\n";
         }
+
+        void emit_svg( svg_writer &o ) const override
+        {
+            o << "<circle cx=\"" << _position.x << "\" cy=\"" << 0 - _position.y
+              << "\" r=\"" << _radius << ( _shade ? "\" fill=\"currentColor\" stroke=\"none\"/>" : "\"/>" );
+        }
+
+        void extend( bounds &b ) const override
+        {
+            b.add( _position.x, _position.y, _radius, _radius );
+        }
     };
 
     struct text : object, label
@@ -221,6 +354,8 @@ namespace umd::pic
         using label::label;
         pic::port port( dir_t ) const override { abort(); }
         void emit( writer &o ) const override { label::emit( o ); }
+        void emit_svg( svg_writer &o ) const override { label::emit_svg( o ); }
+        void extend( bounds &b ) const override { label::extend( b ); }
     };
 
     struct box : object
@@ -254,7 +389,11 @@ namespace umd::pic
             }
         }
 
-        writer &path( writer &o, bool outline ) const
+        /* the nw, ne, se and sw corners: where the corner starts, its control
+         * point and where it ends (all the same unless it is rounded) */
+        using corner_t = std::tuple< point, point, point >;
+
+        std::array< corner_t, 4 > corners() const
         {
             auto round_x = [&]( int p ) { return point( _rounded[ p ] ? 8 : 0, 0 ); };
             auto round_y = [&]( int p ) { return point( 0, _rounded[ p ] ? 8 : 0 ); };
@@ -264,6 +403,14 @@ namespace umd::pic
                   se = _position + point(  _w/2, -_h/2 ),
                   sw = _position + point( -_w/2, -_h/2 );
 
+            return { corner_t{ nw - round_y( 0 ), nw, nw + round_x( 0 ) },
+                     corner_t{ ne - round_x( 1 ), ne, ne - round_y( 1 ) },
+                     corner_t{ se + round_y( 2 ), se, se - round_x( 2 ) },
+                     corner_t{ sw + round_x( 3 ), sw, sw + round_y( 3 ) } };
+        }
+
+        writer &path( writer &o, bool outline ) const
+        {
             auto corner = []( writer &w, auto t ) -> writer &
             {
                 auto [ a, b, c ] = t;
@@ -282,10 +429,7 @@ namespace umd::pic
                 }
             };
 
-            std::tuple c_nw{ nw - round_y( 0 ), nw, nw + round_x( 0 ) },
-                       c_ne{ ne - round_x( 1 ), ne, ne - round_y( 1 ) },
-                       c_se{ se + round_y( 2 ), se, se - round_x( 2 ) },
-                       c_sw{ sw + round_x( 3 ), sw, sw + round_y( 3 ) };
+            auto [ c_nw, c_ne, c_se, c_sw ] = corners();
 
             if ( outline )
             {
@@ -321,30 +465,146 @@ namespace umd::pic
                 o << " withcolor shade_" << std::string( 1, "abcd"[ _shaded - 1 ] ) << ";\n";
             }
         }
+
+        /* the same as path() above: each visible side separately, or the
+         * entire outline as a single closed path */
+        void svg_path( svg_writer &o, bool outline ) const
+        {
+            auto c = corners();
+
+            auto corner = [&]( int i )
+            {
+                auto [ a, b, e ] = c[ i ];
+                o << a;
+                if ( _rounded[ i ] )
+                    o << " C" << b << " " << b << " " << e;
+            };
+
+            if ( outline )
+                for ( int i = 0; i < 4; ++i )
+                {
+                    if ( _hidden[ i ] )
+                        continue;
+
+                    o << "<path d=\"M";
+                    corner( i );
+                    o << " L" << std::get< 0 >( c[ ( i + 1 ) % 4 ] ) << "\"";
+                    o << ( _dashed[ i ] ? " stroke-dasharray=\"1 1.5\"/>" : "/>" );
+                }
+            else
+            {
+                for ( int i = 0; i < 4; ++i )
+                {
+                    o << ( i ? " L" : "M" );
+                    corner( i );
+                }
+
+                o << "Z";
+            }
+        }
+
+        void emit_svg( svg_writer &o ) const override
+        {
+            svg_path( o, true );
+        }
+
+        void fill_svg( svg_writer &o ) const override
+        {
+            if ( _shaded )
+            {
+                o << "<path d=\"";
+                svg_path( o, false );
+                o << "\" fill=\"" << svg_shade[ _shaded - 1 ] << "\" stroke=\"none\"/>";
+            }
+        }
+
+        void extend( bounds &b ) const override
+        {
+            b.add( _position.x, _position.y, _w / 2, _h / 2 );
+        }
     };
 
-    using element_ptr = std::shared_ptr< element >;
-    using object_ptr = std::shared_ptr< object >;
+    /* The elements of a group are allocated from an arena that belongs to
+     * the group, and ‹_objects› owns them: it runs their destructors, while
+     * the memory is released all at once, with the arena. The pointers
+     * returned by add() are valid for as long as the group (or the group it
+     * was moved into) exists. */
 
     struct group : element
     {
-        std::vector< element_ptr > _objects;
+        struct destroy { void operator()( element *e ) const { e->~element(); } };
+
+        using arena = std::pmr::monotonic_buffer_resource;
+        using element_ptr = std::unique_ptr< element, destroy >;
+
+        std::unique_ptr< arena > _arena = std::make_unique< arena >();
+        std::vector< element_ptr > _objects; /* destroyed before the arena */
+
+        group() = default;
+        group( group && ) = default;
+
+        group &operator=( group &&o )
+        {
+            _objects = std::move( o._objects ); /* while our arena still exists */
+            _arena = std::move( o._arena );
+            return *this;
+        }
 
         template< typename T, typename... Args >
-        auto add( Args && ... args )
+        T *add( Args && ... args )
         {
-            auto ptr = std::make_shared< T >( std::forward< Args >( args )... );
-            _objects.push_back( ptr );
+            void *mem = _arena->allocate( sizeof( T ), alignof( T ) );
+            T *ptr = new ( mem ) T( std::forward< Args >( args )... );
+            _objects.emplace_back( ptr );
             return ptr;
         }
 
         void emit( writer &o ) const override
         {
-            for ( auto obj : _objects )
+            for ( auto &obj : _objects )
                 obj->fill( o );
-            for ( auto obj : _objects )
+            for ( auto &obj : _objects )
                 obj->emit( o );
         }
+
+        void emit_svg( svg_writer &o ) const override
+        {
+            for ( auto &obj : _objects )
+                obj->fill_svg( o );
+            for ( auto &obj : _objects )
+                obj->emit_svg( o );
+        }
+
+        void extend( bounds &b ) const override
+        {
+            for ( auto &obj : _objects )
+                obj->extend( b );
+        }
+
+        /* The entire scene as an <svg> element, with one unit per point and
+         * the same pen (.5bp, round) as MetaPost uses by default. Lines and
+         * text are drawn in the current colour, and the text is set in the
+         * font of the surrounding page. */
+
+        void svg( svg_writer &o ) const
+        {
+            bounds b;
+            extend( b );
+
+            if ( b.empty() )
+                b.add( 0, 0 );
+
+            float m = 1; /* room for the pen */
+            float w = b.x1 - b.x0 + 2 * m, h = b.y1 - b.y0 + 2 * m;
+
+            o << "<svg class=\"pic\" xmlns=\"http://www.w3.org/2000/svg\" viewBox=\""
+              << b.x0 - m << " " << 0 - b.y1 - m << " " << w << " " << h << "\" width=\""
+              << w << "pt\" height=\"" << h << "pt\" fill=\"none\" stroke=\"currentColor\""
+              << " stroke-width=\".5\" stroke-linecap=\"round\" stroke-linejoin=\"round\""
+              << " font-size=\"12\" text-anchor=\"middle\" dominant-baseline=\"central\">";
+            emit_svg( o );
+            o << "</svg>";
+        }
     };
 
 }
@@ -9,4 +9,14 @@ namespace umd::pic
         virtual void emit_mpost( std::string_view ) = 0;
         virtual void emit_tex( std::u32string_view ) = 0;
     };
+
+    /* Scenes can also be drawn as SVG directly, without MetaPost (see
+     * group::svg). The markup goes to emit_svg, while the text of each label
+     * goes to emit_label, which is responsible for escaping it. */
+
+    struct svg_writer
+    {
+        virtual void emit_svg( std::string_view ) = 0;
+        virtual void emit_label( std::u32string_view ) = 0;
+    };
 }
@@ -6,10 +6,21 @@
 #include <map>
 #include <string_view>
 #include <limits>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <optional>
+#include <cstdio>
+#include <exception>
+
+#include <brick-hash>
+
+#include "svgtex.hpp"
 
 #include <fcntl.h>
 #include <spawn.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
 
 #include <glib.h>
 #include <poppler.h>
@@ -76,8 +87,10 @@ namespace brq
     }
 }
 
+/* run a program in directory ‹dir› (the current one if empty) and wait for
+ * it to finish, with its output going to ‹out› */
 template< typename... args_t >
-void run( args_t... args )
+void run_to( int out, const std::string &dir, args_t... args )
 {
     std::vector< std::string > argvs = { std::string( args )... };
     char *argv[ sizeof...( args ) + 1 ] = { nullptr };
@@ -88,14 +101,15 @@ void run( args_t... args )
     posix_spawn_file_actions_t fact;
     int pid, status;
 
-    int devnull = open( "/dev/null", O_WRONLY );
     posix_spawn_file_actions_init( &fact );
-    posix_spawn_file_actions_adddup2( &fact, devnull, 1 );
+    posix_spawn_file_actions_adddup2( &fact, out, 1 );
+
+    if ( !dir.empty() )
+        posix_spawn_file_actions_addchdir_np( &fact, dir.c_str() );
 
     int err = posix_spawnp( &pid, argv[ 0 ], &fact, nullptr, argv, environ );
 
     posix_spawn_file_actions_destroy( &fact );
-    close( devnull );
 
     if ( err )
         throw std::runtime_error( "spawn of " + argvs[ 0 ] + " failed" );
@@ -106,97 +120,161 @@ void run( args_t... args )
                 " exit code " + std::to_string( WEXITSTATUS( status ) ) );
 }
 
+template< typename... args_t >
+void run_in( const std::string &dir, args_t... args )
+{
+    int devnull = open( "/dev/null", O_WRONLY );
+
+    try
+    {
+        run_to( devnull, dir, args... );
+    }
+    catch ( ... )
+    {
+        close( devnull );
+        throw;
+    }
+
+    close( devnull );
+}
+
+template< typename... args_t >
+void run( args_t... args ) { run_in( "", args... ); }
+
 auto write_sv = []( int fd, std::string_view str )
 {
     return write( fd, str.begin(), str.size() );
 };
 
-void convert_page( PopplerPage *page, int docid, float scale )
+/* the preamble of tosvg.tex, which the fragments follow */
+const std::string_view preamble[] =
 {
-    double width, height;
+    "\\input{prelude-typescript.tex}\n",
+    "\\newif\\ifbw\\newif\\ifslides\\newif\\ifnotes\\notestrue\n",
+    "\\input{prelude-style.tex}\n",
+    "\\starttext"
+};
 
-    poppler_page_get_size( page, &width, &height );
-    std::string buf;
+/* Rendered fragments are kept in a cache directory (set with -c), one file
+ * per fragment. The name of the file is a hash of the fragment, of the scale
+ * and of the preamble along with the preludes that it loads (so that a change
+ * in the style invalidates the cache). The file holds the vertical shift of
+ * the fragment on its first line (‹-› if it has none), followed by the SVG as
+ * produced by cairo, i.e. before tweak_page. */
 
-    auto do_write = []( void *capture, const unsigned char *data, unsigned len )
+struct cache
+{
+    std::string dir, prelude;
+
+    /* the contents of a prelude, as found by context; if it cannot be found,
+     * only its name goes into the keys */
+    static std::string find_prelude( std::string name )
     {
-        std::string *buf = reinterpret_cast< std::string * >( capture );
-        *buf += std::string_view( reinterpret_cast< const char * >( data ), len );
-        return CAIRO_STATUS_SUCCESS;
-    };
+        int out = open( "find.out", O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+        std::string path;
 
-    auto surface = cairo_svg_surface_create_for_stream( do_write, &buf, width * scale, height * scale );
-    cairo_svg_surface_set_document_unit( surface, CAIRO_SVG_UNIT_PT );
+        try
+        {
+            run_to( out, "", "mtxrun", "--find-file", name );
+        }
+        catch ( const std::runtime_error & ) {}
 
-    auto drawcontext = cairo_create(surface);
-    cairo_scale(drawcontext, scale, scale);
-    poppler_page_render_for_printing(page, drawcontext);
-    cairo_show_page(drawcontext);
-    cairo_destroy(drawcontext);
+        close( out );
+        std::ifstream found( "find.out" );
 
-    drawcontext = cairo_create(surface);
-    cairo_scale(drawcontext, scale, scale);
-    poppler_page_render_for_printing(page, drawcontext);
-    cairo_show_page(drawcontext);
-    cairo_destroy(drawcontext);
+        for ( std::string line; std::getline( found, line ); )
+            if ( !line.empty() )
+                path = line;
 
-    cairo_surface_destroy(surface);
+        std::ifstream in( path, std::ios::binary );
+
+        if ( in.is_open() )
+            return brq::read_file( in );
 
-    std::string_view todo = buf;
+        std::cerr << "warning: could not find " << name << ", the cache will not notice "
+                  << "changes in it" << std::endl;
+        return name;
+    }
 
-    auto unprefix = []( std::string_view &str, std::string_view p )
+    cache( std::string dir ) : dir( dir )
     {
-        if ( str.substr( 0, p.size() ) == p )
-            str.remove_prefix( p.size() );
-    };
+        for ( auto p : preamble )
+            prelude += p;
+        for ( auto n : { "prelude-typescript.tex", "prelude-style.tex" } )
+            prelude += '\0', prelude += find_prelude( n );
+    }
 
-    unprefix( todo, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>" );
+    std::string path( std::string_view text, float scale ) const
+    {
+        std::string key = prelude + '\0' + std::to_string( scale ) + '\0';
+        key += text;
 
-    enum class tweak_t { skip, docid };
+        brq::hash_state a( 0 ), b( 1 );
+        a.update_aligned< true >( reinterpret_cast< const uint8_t * >( key.data() ), key.size() );
+        b.update_aligned< true >( reinterpret_cast< const uint8_t * >( key.data() ), key.size() );
 
-    std::map< std::string_view, tweak_t > tweak =
-    {
-        { "id=\"clip", tweak_t::docid },
-        { "url(#clip", tweak_t::docid },
-        { "id=\"glyph", tweak_t::docid },
-        { "xlink:href=\"#glyph", tweak_t::docid },
-        { "<page>", tweak_t::skip },
-        { "</page>", tweak_t::skip },
-        { "<pageSet>", tweak_t::skip },
-        { "</pageSet>", tweak_t::skip }
-    };
+        char name[ 40 ];
+        snprintf( name, sizeof( name ), "%016llx%016llx.svg",
+                  ( unsigned long long ) a.hash(), ( unsigned long long ) b.hash() );
+        return dir + "/" + name;
+    }
 
-    while ( !todo.empty() )
+    static bool load( const std::string &path, std::string &yshift, std::string &svg )
     {
-        std::string_view next;
-        size_t offset = INT_MAX;
-        tweak_t apply;
+        std::ifstream in( path, std::ios::binary );
 
-        for ( auto [ str, what ] : tweak )
-            if ( todo.find( str ) < offset )
-                offset = todo.find( str ), next = str, apply = what;
+        if ( !in.is_open() || !std::getline( in, yshift ) )
+            return false;
 
-        if ( next.empty() )
-            break;
+        if ( yshift == "-" )
+            yshift.clear();
 
-        auto [ pass, tail ] = brq::split( todo, next );
+        svg.assign( std::istreambuf_iterator< char >( in ), std::istreambuf_iterator< char >() );
+        return !svg.empty();
+    }
 
-        ::write( 1, pass.begin(), pass.size() );
+    /* written into a temporary file first, so that a concurrent run never
+     * sees a partial entry */
+    static void store( const std::string &path, std::string_view yshift, std::string_view svg )
+    {
+        std::string tmp = path + "." + std::to_string( getpid() );
+        std::ofstream out( tmp, std::ios::binary | std::ios::trunc );
 
-        if ( apply == tweak_t::docid )
-        {
-            write_sv( 1, next );
-            write_sv( 1, "-" );
-            write_sv( 1, std::to_string( docid ) );
-            write_sv( 1, "-" );
-        }
+        out << ( yshift.empty() ? "-" : yshift ) << "\n" << svg;
+        out.close();
 
-        todo = tail;
+        if ( !out || std::rename( tmp.c_str(), path.c_str() ) )
+            std::remove( tmp.c_str() );
     }
+};
+
+/* render a page to SVG */
+std::string render_page( PopplerPage *page, float scale )
+{
+    double width, height;
+
+    poppler_page_get_size( page, &width, &height );
+    std::string buf;
+
+    auto do_write = []( void *capture, const unsigned char *data, unsigned len )
+    {
+        std::string *buf = reinterpret_cast< std::string * >( capture );
+        *buf += std::string_view( reinterpret_cast< const char * >( data ), len );
+        return CAIRO_STATUS_SUCCESS;
+    };
 
-    ::write( 1, todo.begin(), todo.size() - 1 );
+    auto surface = cairo_svg_surface_create_for_stream( do_write, &buf, width * scale, height * scale );
+    cairo_svg_surface_set_document_unit( surface, CAIRO_SVG_UNIT_PT );
 
+    auto drawcontext = cairo_create(surface);
+    cairo_scale(drawcontext, scale, scale);
+    poppler_page_render_for_printing(page, drawcontext);
+    cairo_show_page(drawcontext);
+    cairo_destroy(drawcontext);
+
+    cairo_surface_destroy(surface);
     g_object_unref(page);
+    return buf;
 }
 
 std::string read_stdin()
@@ -211,19 +289,13 @@ std::string read_stdin()
     return doc;
 }
 
-void process( float scale )
+void process( float scale, int jobs, const cache *cache )
 {
     std::string doc = read_stdin();
     std::string_view w( doc );
-    std::vector< std::string_view > keep;
+    std::vector< std::string_view > keep, tex;
     std::set< int > use_yshift;
 
-    int mp = open( "tosvg.tex", O_WRONLY | O_CREAT, 0666 );
-    write_sv( mp, "\\input{prelude-typescript.tex}\n" );
-    write_sv( mp, "\\newif\\ifbw\\newif\\ifslides\\newif\\ifnotes\\notestrue\n" );
-    write_sv( mp, "\\input{prelude-style.tex}\n" );
-    write_sv( mp, "\\starttext" );
-
     while ( !w.empty() )
     {
         auto [ pass, examine ] = brq::split( w, "<tex>" );
@@ -234,84 +306,242 @@ void process( float scale )
 
         w = tail;
         keep.push_back( pass );
-        write_sv( mp, process );
+        tex.push_back( process );
     }
 
-    write_sv( mp, "\\stoptext" );
-    close( mp );
-
     if ( keep.size() == 1 )
         return write_sv( 1, keep[ 0 ] ), void();
 
-    try
+    /* Fragment ‹i› is either in the cache, or it is rendered from page
+     * ‹page[ i ]› of the PDF of shard ‹shard_of[ i ]›. The missing fragments
+     * are split into at most ‹jobs› shards (of at least ‹min_shard› fragments
+     * unless fewer are missing in total, since each run of context has a fixed
+     * startup cost), each of which is typeset by its own instance of context,
+     * in a directory of its own. */
+    constexpr size_t min_shard = 16;
+
+    struct shard
+    {
+        std::string dir, pdf;
+        std::vector< size_t > frags;
+        std::exception_ptr error;
+    };
+
+    size_t count = keep.size() - 1;
+    std::vector< std::string > svg( count ), yshift( count ), paths( count ), pages( count );
+    std::vector< int > page( count, -1 ), shard_of( count, -1 );
+    std::vector< size_t > missing;
+    std::vector< shard > shards;
+
+    auto page_scale = [&]( size_t i ) { return use_yshift.count( i ) ? 1 : scale; };
+
+    for ( size_t i = 0; i < count; ++ i )
+        if ( !cache || !cache->load( paths[ i ] = cache->path( tex[ i ], page_scale( i ) ), yshift[ i ], svg[ i ] ) )
+            missing.push_back( i );
+
+    size_t nshards = missing.empty() ? 0 : std::min( size_t( jobs ), std::max< size_t >( 1, missing.size() / min_shard ) );
+
+    for ( size_t s = 0; s < nshards; ++ s )
     {
-        run( "context", "tosvg.tex" );
+        auto &sh = shards.emplace_back();
+        sh.dir = "shard-" + std::to_string( s );
+
+        for ( size_t k = s * missing.size() / nshards; k < ( s + 1 ) * missing.size() / nshards; ++ k )
+        {
+            shard_of[ missing[ k ] ] = s;
+            page[ missing[ k ] ] = sh.frags.size();
+            sh.frags.push_back( missing[ k ] );
+        }
+
+        mkdir( sh.dir.c_str(), 0777 );
+        int mp = open( ( sh.dir + "/tosvg.tex" ).c_str(), O_WRONLY | O_CREAT, 0666 );
+
+        for ( auto p : preamble )
+            write_sv( mp, p );
+        for ( auto i : sh.frags )
+            write_sv( mp, tex[ i ] );
+
+        if ( s == nshards - 1 )
+            write_sv( mp, tex.back() );
+
+        write_sv( mp, "\\stoptext" );
+        close( mp );
     }
-    catch ( const std::runtime_error &err )
+
+    std::vector< std::thread > runs;
+
+    for ( auto &sh : shards )
+        runs.emplace_back( [&]
+        {
+            try
+            {
+                run_in( sh.dir, "context", "tosvg.tex" );
+            }
+            catch ( ... )
+            {
+                sh.error = std::current_exception();
+            }
+        } );
+
+    for ( auto &t : runs )
+        t.join();
+
+    for ( auto &sh : shards )
     {
-        std::string buffer;
-        std::ifstream ifs( "tosvg.log" );
-        while ( std::getline( ifs, buffer ) )
-            std::cerr << buffer << std::endl;
-        std::cerr << std::endl << err.what() << std::endl;
-        exit( 1 );
+        try
+        {
+            if ( sh.error )
+                std::rethrow_exception( sh.error );
+        }
+        catch ( const std::runtime_error &err )
+        {
+            std::string buffer;
+            std::ifstream ifs( sh.dir + "/tosvg.log" );
+            while ( std::getline( ifs, buffer ) )
+                std::cerr << buffer << std::endl;
+            std::cerr << std::endl << err.what() << std::endl;
+            exit( 1 );
+        }
+
+        /* each shard writes the shifts of its own fragments, in order */
+        std::ifstream yshift_in( sh.dir + "/yshift.txt" );
+
+        for ( auto i : sh.frags )
+            if ( use_yshift.count( i ) )
+                yshift_in >> yshift[ i ];
+
+        sh.pdf = brq::read_file( sh.dir + "/tosvg.pdf" );
+        auto bytes = g_bytes_new_static( sh.pdf.data(), sh.pdf.size() );
+        auto pdf = poppler_document_new_from_bytes( bytes, nullptr, nullptr );
+        int npages = poppler_document_get_n_pages( pdf );
+
+        g_object_unref( pdf );
+        g_bytes_unref( bytes );
+
+        if ( int( sh.frags.size() ) != npages )
+            throw std::runtime_error( "each <tex> must produce exactly 1 page" );
     }
 
-    std::ifstream yshift( "yshift.txt" );
+    /* the pages are rendered by a pool of threads, each with its own copies
+     * of the documents (poppler documents cannot be shared between threads),
+     * and written out in order once they are all done */
+    std::atomic< size_t > next = 0;
+    std::vector< std::thread > pool;
+
+    for ( int i = 0; i < std::min( jobs, int( count ) ); ++i )
+        pool.emplace_back( [&]
+        {
+            std::vector< std::pair< GBytes *, PopplerDocument * > > copies( shards.size() );
+
+            for ( size_t k; ( k = next++ ) < count; )
+            {
+                if ( int s = shard_of[ k ]; s >= 0 )
+                {
+                    auto &[ bytes, copy ] = copies[ s ];
+
+                    if ( !copy )
+                    {
+                        bytes = g_bytes_new_static( shards[ s ].pdf.data(), shards[ s ].pdf.size() );
+                        copy = poppler_document_new_from_bytes( bytes, nullptr, nullptr );
+                    }
+
+                    svg[ k ] = render_page( poppler_document_get_page( copy, page[ k ] ), page_scale( k ) );
+                }
 
-    auto pdf_data = brq::read_file( "tosvg.pdf" );
-    auto pdf = poppler_document_new_from_bytes(
-                g_bytes_new_static( pdf_data.data(), pdf_data.size() ), nullptr, nullptr );
+                pages[ k ] = tweak_page( svg[ k ], k );
+            }
 
-    if ( int( keep.size() - 1 ) != poppler_document_get_n_pages( pdf ) )
-        throw std::runtime_error( "each <tex> must produce exactly 1 page" );
+            for ( auto [ bytes, copy ] : copies )
+                if ( copy )
+                    g_object_unref( copy ), g_bytes_unref( bytes );
+        } );
 
-    for ( unsigned i = 0; i < keep.size() - 1; ++ i )
+    for ( auto &t : pool )
+        t.join();
+
+    if ( cache )
+        for ( auto i : missing )
+            cache->store( paths[ i ], yshift[ i ], svg[ i ] );
+
+    shared_defs shared;
+
+    for ( auto &p : pages )
+        p = shared.dedup( p );
+
+    for ( unsigned i = 0; i < count; ++ i )
     {
         bool yshifted = use_yshift.count( i );
         write_sv( 1, keep[ i ] );
 
+        if ( i == 0 )
+            write_sv( 1, shared.block() );
+
         if ( yshifted )
         {
-            std::string yshift_amount;
-            yshift >> yshift_amount;
             write_sv( 1, "<span style=\"vertical-align: " );
-            write_sv( 1, yshift_amount );
+            write_sv( 1, yshift[ i ] );
             write_sv( 1, "pt\">" );
         }
 
-        convert_page( poppler_document_get_page( pdf, i ), i, yshifted ? 1 : scale );
+        write_sv( 1, pages[ i ] );
 
         if ( yshifted )
             write_sv( 1, "</span>" );
     }
 
     write_sv( 1, keep.back() );
-    g_object_unref( pdf );
 }
 
 int main( int argc, char **argv )
 {
     char tmpdir[] = "/tmp/svgtex.XXXXXX";
     float scale = 1.0;
-    char ch;
+    int jobs = std::max( 1u, std::thread::hardware_concurrency() );
+    std::string cache_dir;
+    int ch;
 
-    while ( ( ch = getopt( argc, argv, "s:" ) ) != -1 )
+    while ( ( ch = getopt( argc, argv, "s:j:c:" ) ) != -1 )
         switch ( ch )
         {
             case 's':
                 scale = strtof( optarg, nullptr );
                 break;
+            case 'j':
+                jobs = std::max( 1, atoi( optarg ) );
+                break;
+            case 'c':
+                cache_dir = optarg;
+                break;
             default:
-                std::cerr << "usage: " << argv[ 0 ] << " [-s scale_factor]";
+                std::cerr << "usage: " << argv[ 0 ] << " [-s scale_factor] [-j jobs] [-c cache_dir]";
                 std::exit( 1 );
         }
 
+    if ( !cache_dir.empty() )
+    {
+        char *path;
+
+        if ( ( mkdir( cache_dir.c_str(), 0777 ) && errno != EEXIST ) ||
+             !( path = realpath( cache_dir.c_str(), nullptr ) ) )
+        {
+            std::cerr << "could not create the cache directory " << cache_dir << std::endl;
+            std::exit( 1 );
+        }
+
+        cache_dir = path; /* the rest runs in tmpdir */
+        free( path );
+    }
+
     if ( !mkdtemp( tmpdir ) )
         std::exit( 1 );
 
     chdir( tmpdir );
 
-    process( scale );
+    std::optional< cache > c;
+
+    if ( !cache_dir.empty() )
+        c.emplace( cache_dir );
+
+    process( scale, jobs, c ? &*c : nullptr );
     run( "rm", "-r", tmpdir );
 }
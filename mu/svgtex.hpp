@@ -0,0 +1,198 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <map>
+#include <unordered_map>
+#include <array>
+#include <cstdint>
+
+/* The post-processing of the SVG pages rendered by svgtex, which does not
+ * depend on poppler or cairo (and is benchmarked in bench/svgtex.cpp). */
+
+/* Turn the SVG of a page into a fragment to be placed into HTML, with the ids
+ * of clip paths and glyphs made unique to the page. */
+
+static inline std::string tweak_page( std::string_view todo, int docid )
+{
+    std::string out;
+
+    auto unprefix = []( std::string_view &str, std::string_view p )
+    {
+        if ( str.substr( 0, p.size() ) == p )
+            str.remove_prefix( p.size() );
+    };
+
+    unprefix( todo, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>" );
+
+    /* The rewrites, in a single pass: the patterns are tried at each
+     * position whose first byte starts one of them. No two patterns can match
+     * at the same position. The ids get the page number inserted, the other
+     * patterns are dropped. */
+
+    struct tweak { std::string_view str; bool docid; };
+
+    static const tweak tweaks[] =
+    {
+        { "id=\"clip", true },
+        { "url(#clip", true },
+        { "id=\"glyph", true },
+        { "xlink:href=\"#glyph", true },
+        { "<page>", false },
+        { "</page>", false },
+        { "<pageSet>", false },
+        { "</pageSet>", false }
+    };
+
+    static const auto first = []
+    {
+        std::array< bool, 256 > f{};
+        for ( auto &t : tweaks )
+            f[ uint8_t( t.str[ 0 ] ) ] = true;
+        return f;
+    }();
+
+    std::string id = "-" + std::to_string( docid ) + "-";
+    size_t done = 0;
+
+    out.reserve( todo.size() + todo.size() / 16 );
+
+    for ( size_t i = 0; i < todo.size(); ++ i )
+        if ( first[ uint8_t( todo[ i ] ) ] )
+            for ( auto &t : tweaks )
+                if ( todo.substr( i, t.str.size() ) == t.str )
+                {
+                    out += todo.substr( done, i - done );
+
+                    if ( t.docid )
+                        out += t.str, out += id;
+
+                    done = i + t.str.size();
+                    i = done - 1;
+                    break;
+                }
+
+    todo.remove_prefix( done );
+    out += todo.substr( 0, todo.size() - 1 );
+    return out;
+}
+
+/* Glyphs and clip paths are shared by all the pages: the first time that a
+ * definition is seen, it is moved into a single <defs> block (see block),
+ * under a new id; the same definition on a later page is dropped. In both
+ * cases, the references in the page are rewritten to the new id, and so are
+ * those in the definitions themselves (a clip path may be clipped by another
+ * one), before they are compared. The ids of the pages all carry the page
+ * number (see tweak_page), so the new ids, which do not, never clash with
+ * them. */
+
+struct shared_defs
+{
+    using rename_map = std::map< std::string, std::string, std::less<> >;
+
+    std::unordered_map< std::string, std::string > ids; /* definition, without its id → new id */
+    std::string defs;
+
+    /* the element in ‹svg› whose start tag contains ‹at›, as [ start, end ) */
+    static std::pair< size_t, size_t > element( std::string_view svg, size_t at )
+    {
+        size_t start = svg.rfind( '<', at ), end = svg.find( '>', at );
+
+        if ( start == svg.npos || end == svg.npos )
+            return { svg.npos, svg.npos };
+        if ( svg[ end - 1 ] == '/' )
+            return { start, end + 1 };
+
+        auto name = svg.substr( start + 1, svg.find_first_of( " />", start ) - start - 1 );
+        std::string open = "<" + std::string( name ), close = "</" + std::string( name ) + ">";
+
+        for ( int depth = 1; depth; )
+        {
+            size_t o = svg.find( open, end ), c = svg.find( close, end );
+
+            if ( c == svg.npos )
+                return { svg.npos, svg.npos };
+            if ( o < c && std::string_view( " />" ).find( svg[ o + open.size() ] ) != std::string_view::npos )
+                ++ depth, end = o + open.size();
+            else if ( o < c )
+                end = o + open.size();
+            else
+                -- depth, end = c + close.size();
+        }
+
+        return { start, end };
+    }
+
+    /* ‹text› with the references to the ids in ‹rename› rewritten, i.e. #id
+     * followed by a quote or a paren */
+    static std::string rewrite( std::string_view text, const rename_map &rename )
+    {
+        std::string out;
+        size_t done = 0;
+
+        for ( size_t at = 0; ( at = text.find( '#', at ) ) != text.npos; ++ at )
+        {
+            size_t end = text.find_first_of( "\")", at );
+            if ( end == text.npos )
+                break;
+
+            if ( auto r = rename.find( text.substr( at + 1, end - at - 1 ) ); r != rename.end() )
+            {
+                out += text.substr( done, at + 1 - done );
+                out += r->second;
+                done = end;
+            }
+        }
+
+        out += text.substr( done );
+        return out;
+    }
+
+    std::string dedup( std::string_view svg )
+    {
+        size_t defs_start = svg.find( "<defs>" ), defs_end = svg.find( "</defs>" );
+
+        if ( defs_start == svg.npos || defs_end == svg.npos )
+            return std::string( svg );
+
+        rename_map rename;
+        std::string page( svg.substr( 0, defs_start ) );
+        size_t done = defs_start;
+
+        for ( size_t at = defs_start; ( at = svg.find( " id=\"", at ) ) < defs_end; ++ at )
+        {
+            auto id_start = at + 5, id_end = svg.find( '"', id_start );
+            auto id = svg.substr( id_start, id_end - id_start );
+            std::string_view prefix = id.starts_with( "glyph" ) ? "glyph" : id.starts_with( "clip" ) ? "clip" : "";
+            auto [ start, end ] = element( svg, at );
+
+            if ( prefix.empty() || start < done || end > defs_end )
+                continue;
+
+            /* cairo defines a clip path before those that refer to it, so
+             * the references in the definition are all in ‹rename› by now */
+            auto head = rewrite( svg.substr( start, id_start - start ), rename ),
+                 tail = rewrite( svg.substr( id_end, end - id_end ), rename );
+
+            auto [ it, added ] = ids.try_emplace( head + tail, std::string( prefix ) + "-u" + std::to_string( ids.size() ) );
+
+            if ( added )
+                defs += head, defs += it->second, defs += tail, defs += "\n";
+
+            rename.emplace( id, it->second );
+            page += svg.substr( done, start - done );
+            done = end + ( end < svg.size() && svg[ end ] == '\n' );
+            at = done - 1;
+        }
+
+        page += svg.substr( done );
+        return rewrite( page, rename );
+    }
+
+    /* the block with the shared definitions, to be placed into the HTML */
+    std::string block() const
+    {
+        if ( defs.empty() )
+            return "";
+        return "<svg width=\"0\" height=\"0\" style=\"position: absolute\"><defs>\n" + defs + "</defs></svg>";
+    }
+};